@@ -115,6 +115,19 @@
 #define MAXFILL        2048
 #define MAXFILL_SPARSE 1024
 
+/*
+ * With -d3 the driver checks CHECK_SLICE heap blocks per request with
+ * mm_checkheap_slice, and the whole heap every CHECK_PERIOD requests
+ */
+#define CHECK_SLICE  64
+#define CHECK_PERIOD 4096
+
+/*
+ * With -R a trace whose phase allocates more than REGION_BUDGET bytes in
+ * all is replayed with mm_malloc, since its region would outgrow the heap
+ */
+#define REGION_BUDGET (MAX_DENSE_HEAP / 2)
+
 /*
  * Alignment requirement in bytes (either 4, 8, or 16)
  */
@@ -131,6 +144,19 @@
  */
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
+/*
+ * Huge page mode reserves the dense heap on a HUGE_PAGE_SIZE boundary and
+ * backs it with huge pages: hugetlbfs pages if the system has enough set
+ * aside, transparent huge pages otherwise. The heap break is kept a
+ * multiple of HUGE_PAGE_SIZE. 1 turns the mode on, and 2 also faults the
+ * pages in as the heap grows. The driver's -H flag overrides this.
+ */
+#ifndef HUGEPAGE_MODE
+#define HUGEPAGE_MODE 0
+#endif
+
+#define HUGE_PAGE_SIZE (1UL<<21)  /* 2 MB */
+
 
 /*********** Parameters controlling sparse memory version of heap ***********/
 
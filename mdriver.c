@@ -25,6 +25,7 @@
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 #include "stree.h"
 
@@ -36,6 +37,7 @@
 #define MAXLINE     1024          /* max string size */
 #define HDRLINES       4          /* number of header lines in a trace file */
 #define LINENUM(i) (i+HDRLINES+1) /* cnvt trace request nums to linenums (origin 1) */
+#define RSS_PERIOD   256          /* requests between resident size samples (-F) */
 
 #ifndef REF_ONLY
 #define REF_ONLY 0
@@ -81,9 +83,12 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
     long index;                         /* index for free() to use later */
     size_t size;                        /* byte size of alloc/realloc request */
+    size_t align;                       /* alignment of memalign request */
+    int run;                            /* like requests from here on (-B) */
+    bool last;                          /* free that ends a phase (-R) */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -97,6 +102,9 @@ typedef struct {
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+    char **batch;         /* scratch array of pointers for -B */
+    mm_region_t *region;  /* region the trace allocates from, for -R */
+    bool regions;         /* -R, and no phase allocates over REGION_BUDGET */
 } trace_t;
 
 /*
@@ -123,6 +131,16 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double lat_med;    /* median request latency in ns (only with -L) */
+    double lat_p999;   /* 99.9th percentile request latency in ns */
+    double lat_max;    /* worst-case request latency in ns */
+    double fp_peak;    /* largest heap + mapped bytes during the trace */
+    double fp_mean;    /* heap + mapped bytes averaged over all requests */
+    double fp_end;     /* heap + mapped bytes once the trace is done */
+    double fp_rss;     /* resident heap + mapped bytes, sampled (-F only) */
+    double fp_live;    /* bytes held by the trace, averaged likewise */
+    bool counted;      /* counters holds the allocator's counters (-C) */
+    mm_stats_t counters; /* mm_stats at the end of the utilization pass */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -140,7 +158,9 @@ typedef struct {
  * at a "random" place (a hash of the index), and copy random data
  * into it.  With DBG_CHEAP, we check that the data survived when we
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
+ * every operation.  DBG_INCREMENTAL checks data like DBG_CHEAP, a slice of
+ * the heap every operation and all of it every CHECK_PERIOD operations and
+ * at the end of the trace.
  * randint_t should be a byte, in case students return unaligned memory.
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
@@ -155,13 +175,20 @@ static randint_t random_data[RANDOM_DATA_LEN];
  *******************/
 
 /* Global values */
-typedef enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode_t;
+typedef enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE, DBG_INCREMENTAL } debug_mode_t;
 
 static debug_mode_t debug_mode = REF_ONLY ? DBG_NONE : DBG_CHEAP;
 int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool latency_mode = false; /* Report per-request latency for each trace */
+static bool footprint_mode = false; /* Report how the heap footprint evolves */
+static bool batch_mode = false;   /* Replay runs of like requests as batches */
+static bool sized_mode = false;   /* Pass the block size to frees */
+static bool region_mode = false;  /* Allocate each phase from a region */
+static bool counter_mode = false; /* Report the allocator's counters */
+static int huge_mode = HUGEPAGE_MODE; /* Back the heap with huge pages */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -208,6 +235,12 @@ static void free_range_set(range_set_t *ranges);
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static bool check_index(const trace_t *trace, int opnum, int index);
+static bool replay_batch(trace_t *trace, int opnum);
+static bool replay_init(trace_t *trace);
+static char *replay_malloc(trace_t *trace, size_t size);
+static char *replay_memalign(trace_t *trace, size_t align, size_t size);
+static char *replay_realloc(trace_t *trace, int index, size_t size);
+static void replay_free(const trace_t *trace, int opnum, char *p);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
@@ -223,11 +256,15 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printlatency(int n, stats_t *stats);
+static void printfootprint(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -275,6 +312,9 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
         mm_stats[i].ops = trace->num_ops;
+        if (region_mode && !trace->regions)
+            printf("\n%s: a phase allocates over %d MB, replaying without -R\n",
+                   trace->filename, REGION_BUDGET >> 20);
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0) {
@@ -294,13 +334,15 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (latency_mode && !sparse_mode)
+                eval_mm_latency(trace, &mm_stats[i]);
         }
 
         free_trace(trace);
@@ -348,7 +390,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:H:hpOVAlDTLFBSRC")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -405,6 +447,34 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'L': /* Report worst-case request latency */
+            latency_mode = true;
+            break;
+
+        case 'F': /* Report heap footprint over time */
+            footprint_mode = true;
+            break;
+
+        case 'B': /* Use the batch malloc and free calls */
+            batch_mode = true;
+            break;
+
+        case 'S': /* Use the sized free call */
+            sized_mode = true;
+            break;
+
+        case 'R': /* Allocate each phase of a trace from a region */
+            region_mode = true;
+            break;
+
+        case 'C': /* Report the allocator's counters */
+            counter_mode = true;
+            break;
+
+        case 'H': /* Huge page mode: 0 off, 1 on, 2 with prefault */
+            huge_mode = atoi(optarg);
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -416,6 +486,13 @@ int main(int argc, char **argv)
     }
 #endif /* !REF_ONLY */
 
+    if (batch_mode && region_mode)
+        app_error("-B and -R cannot be used together\n");
+    if (sparse_mode && region_mode)
+        app_error("-R cannot be used with the sparse heap\n");
+
+    mem_huge_pages(huge_mode);
+
     if (num_global_tracefiles == 0) {
         int i;
         for (i = 0; default_tracefiles[i]; i++)
@@ -497,6 +574,12 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (latency_mode)
+                printlatency(num_global_tracefiles, mm_stats);
+            if (footprint_mode)
+                printfootprint(num_global_tracefiles, mm_stats);
+            if (counter_mode)
+                printcounters(num_global_tracefiles, mm_stats);
         }
     }
 
@@ -692,9 +775,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within one
+       of the regions the package mapped for large blocks */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_mapped(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -870,10 +955,13 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     int index;
-    size_t size;
+    size_t size, align;
     int max_index = 0;
     int op_index;
     int ignore = 0;
+    bool *live;           /* which ids are allocated, to find phases */
+    int num_live = 0;
+    size_t phase_bytes = 0; /* bytes allocated so far in the current phase */
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -919,6 +1007,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
          calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
+    /* and room to pass a run of requests to the batch calls */
+    if ((trace->batch =
+         (char **)malloc(trace->num_ops * sizeof(char *))) == NULL)
+        unix_error("malloc 6 failed in read_trace");
+
 
     /* read every request line in the trace file */
     index = 0;
@@ -939,6 +1032,14 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].align = align;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             ignore += fscanf(tracefile, "%u", &index);
             trace->ops[op_index].type = FREE;
@@ -955,6 +1056,47 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+    /* count the frees, or same-size allocs, that follow each request */
+    for (op_index = trace->num_ops - 1; op_index >= 0; op_index--) {
+        traceop_t *op = &trace->ops[op_index];
+        op->run = 1;
+        if (op_index + 1 < trace->num_ops &&
+            (op->type == ALLOC || op->type == FREE) &&
+            op[1].type == op->type &&
+            (op->type == FREE || op[1].size == op->size))
+            op->run = op[1].run + 1;
+    }
+
+    /* mark the frees that leave no block allocated, which end a phase,
+       and keep -R off the trace if a phase allocates too much */
+    if ((live = (bool *)calloc(trace->num_ids, sizeof(bool))) == NULL)
+        unix_error("malloc 7 failed in read_trace");
+    trace->regions = region_mode;
+    for (op_index = 0; op_index < trace->num_ops; op_index++) {
+        traceop_t *op = &trace->ops[op_index];
+        op->last = false;
+        if (op->type != FREE) {
+            phase_bytes += op->size + (op->type == MEMALIGN ? op->align : 0);
+            if (phase_bytes > REGION_BUDGET)
+                trace->regions = false;
+        }
+        if (op->type == FREE) {
+            if (op->index >= 0 && live[op->index]) {
+                live[op->index] = false;
+                op->last = --num_live == 0;
+                if (op->last)
+                    phase_bytes = 0;
+            }
+        } else if (!live[op->index] && op->size > 0) {
+            live[op->index] = true;
+            num_live++;
+        } else if (live[op->index] && op->size == 0) {
+            live[op->index] = false;
+            num_live--;
+        }
+    }
+    free(live);
+
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
@@ -974,15 +1116,16 @@ static void reinit_trace(trace_t *trace)
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
+ * free_trace - Free the trace record and the five arrays it points
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    free(trace->ops);         /* free the five arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
+    free(trace->batch);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -1009,7 +1152,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     reinit_trace(trace);
 
     /* Call the mm package's init function */
-    if (!mm_init()) {
+    if (!replay_init(trace)) {
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
@@ -1039,12 +1182,65 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
         }
 
+        if (debug_mode == DBG_INCREMENTAL) {
+            /* Let the students check the next slice of their heap */
+            if (!mm_checkheap_slice(0, CHECK_SLICE) ||
+                (i % CHECK_PERIOD == 0 && !mm_checkheap(0))) {
+                malloc_error(trace, i, "mm_checkheap returned false\n");
+                return false;
+            }
+        }
+
+        if (batch_mode &&
+            (trace->ops[i].type == ALLOC || trace->ops[i].type == FREE)) {
+            int k, n = trace->ops[i].run;
+
+            /* Check and forget the blocks about to be freed */
+            for (k = 0; trace->ops[i].type == FREE && k < n; k++) {
+                index = trace->ops[i + k].index;
+                if (!check_index(trace, i + k, index))
+                {
+                    allCheck = false;
+                }
+                if (index >= 0)
+                    remove_range(ranges, trace->blocks[index]);
+            }
+
+            if (!replay_batch(trace, i)) {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+
+            /* Check each new block as mm_malloc's would be */
+            for (k = 0; trace->ops[i].type == ALLOC && k < n; k++) {
+                index = trace->ops[i + k].index;
+                if (add_range(ranges, trace->blocks[index], size,
+                              trace, i + k, index) == 0)
+                    return false;
+                randomize_block(trace, index);
+            }
+            i += n - 1;
+            continue;
+        }
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if (trace->ops[i].type == MEMALIGN) {
+                size_t align = trace->ops[i].align;
+                if ((p = replay_memalign(trace, align, size)) == NULL) {
+                    malloc_error(trace, i, "mm_memalign failed.");
+                    return false;
+                }
+                if (((size_t) p & (align - 1)) != 0) {
+                    malloc_error(trace, i, "Payload address (%p) not "
+                                 "aligned to %zu bytes", p, align);
+                    return false;
+                }
+            } else if ((p = replay_malloc(trace, size)) == NULL) {
                 malloc_error(trace, i, "mm_malloc failed.");
                 return false;
             }
@@ -1073,7 +1269,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /* Call the student's realloc */
             oldp = trace->blocks[index];
-            newp = mm_realloc(oldp, size);
+            newp = replay_realloc(trace, index, size);
             if ( (newp == NULL) && (size != 0) ) {
                 malloc_error(trace, i, "mm_realloc failed.");
                 return false;
@@ -1125,13 +1321,28 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            replay_free(trace, i, p);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
     }
+
+    if (debug_mode == DBG_INCREMENTAL) {
+        range_t *r;
+
+        /* Check the whole heap, and the blocks the trace left allocated */
+        if (!mm_checkheap(0)) {
+            malloc_error(trace, trace->num_ops, "mm_checkheap returned false\n");
+            return false;
+        }
+        for (r = ranges->list; r != NULL; r = r->next) {
+            if (!check_index(trace, trace->num_ops, r->index))
+                allCheck = false;
+        }
+    }
+
     /* As far as we know, this is a valid malloc package */
     return allCheck;
 }
@@ -1140,42 +1351,88 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/footprint, where footprint is the
+ *   largest heap size plus mem_map'ed bytes seen while running the
+ *   student's malloc package on the trace. Mapped regions can be
+ *   returned to the system and the heap can be trimmed, so the
+ *   footprint at the end of the trace may be smaller than its high
+ *   water mark. Both, and the mean footprint over the trace, are
+ *   recorded in stats for -F.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
     int i;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    double footprint_sum = 0;
+    double rss_sum = 0, live_sum = 0;
+    int samples = 0, next_sample = 0;
     char *p;
-    char *newp, *oldp;
+    char *newp;
 
     reinit_trace(trace);
 
-    /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
-    if (!mm_init())
+    /* initialize the heap and the mm malloc package. For -F the heap's
+       pages are given back first, so only this pass counts as resident */
+    if (footprint_mode) {
+        mem_deinit();
+        mem_init(sparse_mode);
+    } else
+        mem_reset_brk();
+    if (!replay_init(trace))
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0;  i < trace->num_ops;  i++) {
+        if (footprint_mode && i >= next_sample) {
+            rss_sum += mem_resident();
+            live_sum += total_size;
+            samples++;
+            next_sample = i + RSS_PERIOD;
+        }
+        if (batch_mode &&
+            (trace->ops[i].type == ALLOC || trace->ops[i].type == FREE)) {
+            int k, n = trace->ops[i].run;
+
+            for (k = 0; k < n; k++) {
+                index = trace->ops[i + k].index;
+                if (trace->ops[i].type == ALLOC)
+                    total_size += trace->ops[i].size;
+                else if (index >= 0)
+                    total_size -= trace->block_sizes[index];
+            }
+            if (!replay_batch(trace, i))
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+
+            max_total_size = (total_size > max_total_size) ?
+                total_size : max_total_size;
+            footprint_sum += (double)n * (mem_heapsize() + mem_mapped_bytes());
+            i += n - 1;
+            continue;
+        }
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            p = (trace->ops[i].type == MEMALIGN) ?
+                replay_memalign(trace, trace->ops[i].align, size) :
+                replay_malloc(trace, size);
+            if (p == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
+            /* with -F, use the block as a program would, so it is resident;
+               not in a sparse heap, whose blocks may be terabytes */
+            if (footprint_mode && !sparse_mode)
+                mem_memset(p, 0x5a, size);
 
             /* Remember region and size */
             trace->blocks[index] = p;
@@ -1189,11 +1446,13 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             newsize = trace->ops[i].size;
             oldsize = trace->block_sizes[index];
 
-            oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0) {
+            newp = replay_realloc(trace, index, newsize);
+            if (newp == NULL && newsize != 0) {
                 app_error("trace %d: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
+            if (footprint_mode && !sparse_mode && newsize > oldsize)
+                mem_memset(newp + oldsize, 0x5a, newsize - oldsize);
 
             /* Remember region and size */
             trace->blocks[index] = newp;
@@ -1212,7 +1471,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            replay_free(trace, i, p);
 
             total_size -= size;
             break;
@@ -1225,13 +1484,24 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
+        footprint_sum += mem_heapsize() + mem_mapped_bytes();
+    }
+
+    stats->fp_peak = mem_peak_footprint();
+    stats->fp_mean = footprint_sum / trace->num_ops;
+    stats->fp_end = mem_heapsize() + mem_mapped_bytes();
+    if (samples > 0) {
+        stats->fp_rss = rss_sum / samples;
+        stats->fp_live = live_sum / samples;
     }
+    if (counter_mode)
+        stats->counted = mm_stats(&stats->counters);
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -1243,34 +1513,53 @@ static void eval_mm_speed(void *ptr)
 {
     int i, index;
     size_t size, newsize;
-    char *p, *newp, *oldp, *block;
+    char *p, *newp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (!mm_init())
+    if (!replay_init(trace))
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
+    for (i = 0;  i < trace->num_ops;  i++) {
+        if (batch_mode &&
+            (trace->ops[i].type == ALLOC || trace->ops[i].type == FREE)) {
+            if (!replay_batch(trace, i))
+                app_error("mm_malloc_batch error in eval_mm_speed");
+            i += trace->ops[i].run - 1;
+            continue;
+        }
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = replay_malloc(trace, size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = replay_memalign(trace, trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
+            newp = replay_realloc(trace, index, newsize);
+            if (newp == NULL && newsize != 0)
                 app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
+            trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* mm_free */
@@ -1280,12 +1569,192 @@ static void eval_mm_speed(void *ptr)
             } else {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            replay_free(trace, i, block);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_speed");
         }
+    }
+}
+
+/*
+ * replay_init - Initialize the mm package for a pass over the trace and,
+ *     under -R, create the region the pass allocates from.
+ */
+static bool replay_init(trace_t *trace)
+{
+    if (!mm_init())
+        return false;
+    trace->region = NULL;
+    if (trace->regions && (trace->region = mm_region_create()) == NULL)
+        return false;
+    return true;
+}
+
+/*
+ * replay_malloc - Allocate size bytes with mm_malloc, or from the trace's
+ *     region under -R.
+ */
+static char *replay_malloc(trace_t *trace, size_t size)
+{
+    if (trace->regions)
+        return mm_region_alloc(trace->region, size);
+    return mm_malloc(size);
+}
+
+/*
+ * replay_memalign - Like replay_malloc, for a block aligned to align
+ *     bytes. Region blocks are only 16-byte aligned, so under -R the
+ *     request takes align bytes more and the pointer is rounded up.
+ */
+static char *replay_memalign(trace_t *trace, size_t align, size_t size)
+{
+    char *p;
+
+    if (!trace->regions)
+        return mm_memalign(align, size);
+    if ((p = mm_region_alloc(trace->region, size + align)) == NULL)
+        return NULL;
+    return p + (align - (size_t)p % align) % align;
+}
+
+/*
+ * replay_realloc - Resize block index to size bytes with mm_realloc.
+ *     Under -R the old block stays in the region until the phase ends, and
+ *     its contents are copied to a new one.
+ */
+static char *replay_realloc(trace_t *trace, int index, size_t size)
+{
+    char *oldp = trace->blocks[index];
+    size_t oldsize = trace->block_sizes[index];
+    char *newp;
+
+    if (!trace->regions)
+        return mm_realloc(oldp, size);
+    if ((newp = mm_region_alloc(trace->region, size)) != NULL && oldp != NULL)
+        mem_memcpy(newp, oldp, size < oldsize ? size : oldsize);
+    return newp;
+}
+
+/*
+ * replay_free - Free block p of request opnum, passing mm_free_sized the
+ *     size it was last allocated or reallocated with under -S. Under -R
+ *     blocks are not freed one by one; the free that leaves none allocated
+ *     resets the region instead.
+ */
+static void replay_free(const trace_t *trace, int opnum, char *p)
+{
+    int index = trace->ops[opnum].index;
+
+    if (trace->regions) {
+        if (trace->ops[opnum].last)
+            mm_region_reset(trace->region);
+    } else if (sized_mode && p != NULL)
+        mm_free_sized(p, trace->block_sizes[index]);
+    else
+        mm_free(p);
+}
+
+/*
+ * replay_batch - Issue the run of allocs or frees starting at request
+ *     opnum as a single mm_malloc_batch or mm_free_batch call. Returns
+ *     false if mm_malloc_batch came up short.
+ */
+static bool replay_batch(trace_t *trace, int opnum)
+{
+    traceop_t *op = &trace->ops[opnum];
+    int k;
+
+    if (op->type == ALLOC) {
+        if (mm_malloc_batch(op->size, op->run, (void **)trace->batch)
+            != (size_t)op->run)
+            return false;
+        for (k = 0; k < op->run; k++) {
+            trace->blocks[op[k].index] = trace->batch[k];
+            trace->block_sizes[op[k].index] = op->size;
+        }
+    } else {
+        for (k = 0; k < op->run; k++)
+            trace->batch[k] = (op[k].index < 0) ?
+                NULL : trace->blocks[op[k].index];
+        mm_free_batch((void **)trace->batch, op->run);
+    }
+    return true;
+}
+
+/*
+ * compare_double - qsort comparison for eval_mm_latency
+ */
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_latency - Replay the trace once, timing every request on its
+ *    own, and report the median, 99.9th percentile and worst-case latency.
+ *    Throughput hides the occasional expensive request (a long free list
+ *    walk, a heap extension); this is how we catch them.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index;
+    size_t size;
+    char *p;
+    double *lat;
+
+    if ((lat = (double *) malloc(trace->num_ops * sizeof(double))) == NULL)
+        unix_error("malloc failed in eval_mm_latency");
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!replay_init(trace))
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        start_timer();
+        switch (trace->ops[i].type) {
+        case ALLOC: /* mm_malloc */
+            if ((p = replay_malloc(trace, size)) == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            if ((p = replay_memalign(trace, trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            if ((p = replay_realloc(trace, index, size)) == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* mm_free */
+            replay_free(trace, i, index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+        lat[i] = get_timer() * 1e9;
+    }
+
+    qsort(lat, trace->num_ops, sizeof(double), compare_double);
+    stats->lat_med = lat[trace->num_ops / 2];
+    stats->lat_p999 = lat[(int) (trace->num_ops * 0.999)];
+    stats->lat_max = lat[trace->num_ops - 1];
+    free(lat);
 }
 
 /*
@@ -1313,6 +1782,15 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align,
+                                   trace->ops[i].size)) == NULL) {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1364,6 +1842,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1564,6 +2050,109 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printfootprint - prints the footprint recorded by eval_mm_util, in KB, and
+ *     how far the footprint dropped from its peak by the end of the trace
+ */
+static void printfootprint(int n, stats_t *stats)
+{
+    int i;
+    double peak = 0, end = 0, rss = 0, live = 0;
+
+    printf("Heap footprint (KB):\n");
+    printf("  %8s%10s%10s%8s%10s%10s  %s\n", "peak", "mean", "end", "drop",
+           "rss", "live", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid) {
+            printf("  %8s%10s%10s%8s%10s%10s  %s\n", "-", "-", "-", "-", "-",
+                   "-", stats[i].filename);
+            continue;
+        }
+        printf("  %8.0f%10.0f%10.0f%7.1f%%%10.0f%10.0f  %s\n",
+               stats[i].fp_peak / 1024, stats[i].fp_mean / 1024,
+               stats[i].fp_end / 1024,
+               100.0 * (1.0 - stats[i].fp_end / stats[i].fp_peak),
+               stats[i].fp_rss / 1024, stats[i].fp_live / 1024,
+               stats[i].filename);
+        peak += stats[i].fp_peak;
+        end += stats[i].fp_end;
+        rss += stats[i].fp_rss;
+        live += stats[i].fp_live;
+    }
+    printf("Total footprint at end of traces = %.0f KB of %.0f KB peak.\n",
+           end / 1024, peak / 1024);
+    printf("Mean resident = %.0f KB, holding %.0f KB of live blocks.\n"
+           "rss and live are sampled every %d requests.\n\n",
+           rss / 1024, live / 1024, RSS_PERIOD);
+}
+
+/*
+ * printcounters - prints the allocator's counters as they stood at the end
+ * of each trace's utilization pass
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i, j;
+
+    printf("Allocator counters:\n");
+    printf("  %9s%9s%9s%8s%7s%8s%7s%7s%6s%7s%8s  %s\n", "mallocs", "frees",
+           "reallocs", "exam", "cyc", "split", "merge", "grow", "trim",
+           "free", "purged", "trace");
+    for (i = 0; i < n; i++) {
+        const mm_stats_t *c = &stats[i].counters;
+        unsigned long coalesces, merges, free_blocks = 0;
+
+        if (!stats[i].valid || !stats[i].counted) {
+            printf("  %9s%9s%9s%8s%7s%8s%7s%7s%6s%7s%8s  %s\n", "-", "-",
+                   "-", "-", "-", "-", "-", "-", "-", "-", "-",
+                   stats[i].filename);
+            continue;
+        }
+        merges = c->coalesce_next + c->coalesce_prev + c->coalesce_both;
+        coalesces = c->coalesce_none + merges;
+        for (j = 0; j < c->classes; j++)
+            free_blocks += c->class_blocks[j];
+        printf("  %9lu%9lu%9lu%8.2f%7.0f%7.1f%%%6.1f%%%7lu%6lu%7lu%8lu  %s\n",
+               c->mallocs, c->frees, c->reallocs,
+               c->fit_searches ? (double)c->fit_candidates / c->fit_searches : 0,
+               c->fit_searches ? (double)c->fit_cycles / c->fit_searches : 0,
+               c->splits + c->exact_fits ?
+                   100.0 * c->splits / (c->splits + c->exact_fits) : 0,
+               coalesces ? 100.0 * merges / coalesces : 0,
+               c->heap_extends, c->heap_trims, free_blocks,
+               c->purged_bytes >> 10,
+               stats[i].filename);
+    }
+    printf("exam = blocks examined per find_fit, cyc = cycles per find_fit\n"
+           "(0 without MM_STATS_CYCLES),\nsplit = placements that split a block, merge = frees that "
+           "coalesced,\ngrow = heap extensions, trim = times the break was "
+           "lowered,\nfree = free blocks at end, "
+           "purged = KB of free pages purged.\n\n");
+}
+
+/*
+ * printlatency - prints the per-request latency measured by eval_mm_latency
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    int i;
+    double worst = 0;
+
+    printf("Request latency (ns):\n");
+    printf("  %8s%10s%10s  %s\n", "median", "99.9%", "max", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid) {
+            printf("  %8s%10s%10s  %s\n", "-", "-", "-", stats[i].filename);
+            continue;
+        }
+        printf("  %8.0f%10.0f%10.0f  %s\n", stats[i].lat_med,
+               stats[i].lat_p999, stats[i].lat_max, stats[i].filename);
+        if (stats[i].lat_max > worst)
+            worst = stats[i].lat_max;
+    }
+    printf("Worst-case request latency = %.0f ns.\n\n", worst);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1688,7 +2277,7 @@ static void usage(char *prog)
     fprintf(stderr, "Usage: %s [-hlVdD] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-p         Calculate Checkpoint Score.\n");
-    fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
+    fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots; 3 incremental.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
     fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
@@ -1698,5 +2287,12 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-L         Report per-request latency (median, 99.9%%, max)\n");
+    fprintf(stderr, "\t-F         Report heap footprint (peak, mean, end of trace, resident)\n");
+    fprintf(stderr, "\t-B         Replay runs of same-size allocs, and of frees, as batches\n");
+    fprintf(stderr, "\t-S         Pass each block's size to mm_free_sized\n");
+    fprintf(stderr, "\t-R         Allocate each phase of a trace from a region\n");
+    fprintf(stderr, "\t-C         Report the allocator's counters (needs MM_STATS)\n");
+    fprintf(stderr, "\t-H <i>     Huge page heap: 0 off; 1 on; 2 on and prefaulted.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -4,6 +4,16 @@
  * package with the system's malloc package in libc.
  *
  * This version has been updated to enable sparse emulation of very large heaps
+ *
+ * The heap's address space is reserved once, without access, and made
+ * accessible in COMMIT_STEP pieces as the break rises. Between traces only
+ * its pages are given back, and the reservation is reused.
+ *
+ * A sparse heap starts at SPARSE_HEAP_START and may grow to MAX_SPARSE_HEAP
+ * bytes. Its addresses are not backed by memory: mem_read, mem_write,
+ * mem_memset and mem_memcpy look up SPARSE_PAGE_SIZE pages in a hash table
+ * and make a page on the first write of something other than zero, so
+ * untouched memory costs nothing and reads as zero.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,57 +22,122 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Reserved heap pages are made accessible this many bytes at a time */
+#define COMMIT_STEP ((size_t)1 << 20)
+
 /* private global variables */
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
 static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static unsigned char *committed;            /* Heap below here is accessible */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
 
+/* Regions handed out by mem_map, outside the heap */
+typedef struct {
+    unsigned char *addr;
+    size_t len;
+} mapping_t;
+static mapping_t *mappings = NULL;          /* Live regions */
+static int num_mappings = 0;
+static int max_mappings = 0;
+static size_t mapped_bytes = 0;             /* Total length of live regions */
+static size_t peak_footprint = 0;           /* Max of heap plus mapped bytes */
+static unsigned char *fresh_lo;             /* Heap above here reads as zero */
+
+/* Huge page mode */
+static int huge_mode = HUGEPAGE_MODE;       /* 0 off, 1 on, 2 with prefault */
+static int reserved_mode = -1;              /* huge_mode of the reserved heap */
+static size_t granule = 1;                  /* Break is kept a multiple of this */
+static unsigned char *prefaulted;           /* Heap below here is faulted in */
+static unsigned char *dense_heap;           /* The reservation, once made */
+
+/* Sparse emulation */
+typedef struct sparse_page {
+    uintptr_t index;                        /* Address / SPARSE_PAGE_SIZE */
+    struct sparse_page *next;               /* Next page in the bucket */
+    unsigned char data[SPARSE_PAGE_SIZE];
+} sparse_page_t;
+static bool sparse;                         /* Is the heap emulated? */
+static sparse_page_t **buckets;             /* Hash table of pages */
+static size_t num_buckets;                  /* A power of two, or 0 */
+static size_t num_pages;
+
 static void print_stats();
+static void update_peak();
+static void release_pages(unsigned char *lo, unsigned char *hi);
+static size_t resident_bytes(unsigned char *addr, size_t len);
+static void unmap_all();
+static void reserve_heap();
+static bool commit(unsigned char *hi);
+static void *map_huge(size_t len);
+static void prefault(unsigned char *hi);
+static uintptr_t align_up(uintptr_t addr, size_t n);
+static size_t release_unit();
+static bool in_sparse(const void *addr);
+static sparse_page_t *sparse_find(uintptr_t index);
+static sparse_page_t *sparse_get(uintptr_t index);
+static void sparse_zero(uintptr_t lo, uintptr_t hi);
+static void sparse_clear();
+static void sparse_copy_out(void *dest, uintptr_t src, size_t n);
+static void sparse_copy_in(uintptr_t dest, const void *src, size_t n);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model, with a sparse heap if
+ *     sparse_heap is set. The dense heap's address space is reserved on
+ *     first use and kept from then on; later calls only give back the
+ *     pages the last run wrote, so they read as zero.
  */
-void mem_init(){
-    /* Dense allocation */
-    mmap_length = MAX_DENSE_HEAP;
-
-    int dev_zero = open("/dev/zero", O_RDWR);
-    void *start = TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,        /* suggested start*/
-                      mmap_length,  /* length */
-                      PROT_WRITE,   /* permissions */
-                      MAP_PRIVATE,  /* private or shared? */
-                      dev_zero,            /* fd */
-                      0);            /* offset */
-    if (addr == MAP_FAILED) {
-        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
-        exit(1);
+void mem_init(bool sparse_heap){
+    if (sparse)
+        sparse_clear();
+    else if (heap != NULL)
+        release_pages(heap, fresh_lo);
+    sparse = sparse_heap;
+    if (sparse) {
+        heap = SPARSE_HEAP_START;
+        mem_max_addr = heap + MAX_SPARSE_HEAP;
+        granule = 1;
+    } else {
+        if (dense_heap != NULL && reserved_mode != huge_mode) {
+            munmap(dense_heap, mmap_length);
+            dense_heap = NULL;
+        }
+        if (dense_heap == NULL)
+            reserve_heap();
+        heap = dense_heap;
+        mem_max_addr = heap + MAX_DENSE_HEAP;
+        granule = reserved_mode ? HUGE_PAGE_SIZE : 1;
     }
-    
-    heap = addr;
-    mem_max_addr = heap + MAX_DENSE_HEAP;
-    
+
     stats_printed = false;
     mem_brk = heap;
+    fresh_lo = heap;
+    prefaulted = heap;
     mem_reset_brk();
 }
 
 /* 
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - free the storage used by the memory system model. The
+ *     heap's pages go back to the system, but its address space stays
+ *     reserved for the next mem_init.
  */
 void mem_deinit(void){
     print_stats();
-    munmap(heap, mmap_length);
+    unmap_all();
+    if (sparse)
+        sparse_clear();
+    else
+        release_pages(heap, fresh_lo);
+    fresh_lo = heap;
+    prefaulted = heap;
 }
 
 /*
@@ -70,31 +145,54 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
     print_stats();
+    unmap_all();
     mem_brk = heap;
+    peak_footprint = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *                by incr bytes and returns the start address of the new area. In
- *                this model, the heap cannot be shrunk.
+ *                by incr bytes and returns the start address of the new area.
+ *                A negative incr shrinks the heap, and the pages wholly above
+ *                the new break are given back to the system.
  */
 void *mem_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
     if (incr < 0) {
-        ok = false;
-        fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
+        if (mem_brk + incr < heap) {
+            errno = ENOMEM;
+            fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) incr);
+            return (void *) -1;
+        }
+        /* The process break is left alone, since libc may have moved it.
+           Pages an earlier run left dirty above the break go as well. */
+        mem_brk += incr;
+        release_pages(mem_brk, fresh_lo > old_brk ? fresh_lo : old_brk);
+        unsigned char *released = (unsigned char *)
+            align_up((uintptr_t) mem_brk, release_unit());
+        if (fresh_lo > released)
+            fresh_lo = released;
+        if (prefaulted > released)
+            prefaulted = released;
+        return (void *) old_brk;
     } else if (mem_brk + incr > mem_max_addr) {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
         fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (sbrk(incr) == (void*) -1) {
+    } else if (!sparse && mem_brk + incr > committed &&
+               !commit(mem_brk + incr)) {
         ok = false;
         fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
     if (ok) {
         mem_brk += incr;
+        if (fresh_lo < mem_brk)
+            fresh_lo = mem_brk;
+        if (!sparse && huge_mode == 2 && prefaulted < mem_brk)
+            prefault(mem_brk);
+        update_peak();
         return (void *) old_brk;
     } else {
         errno = ENOMEM;
@@ -102,6 +200,117 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mem_map - map a fresh, zero-filled region of size bytes outside the heap.
+ *     size is rounded up to whole pages and the region is page aligned.
+ *     Returns (void *) -1 on failure, like mem_sbrk.
+ */
+void *mem_map(size_t size) {
+    size_t len = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: mem_map failed.  Could not map %zu bytes\n", len);
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    if (num_mappings == max_mappings) {
+        max_mappings = max_mappings ? 2 * max_mappings : 16;
+        mappings = realloc(mappings, max_mappings * sizeof(mapping_t));
+        assert(mappings != NULL);
+    }
+    mappings[num_mappings].addr = addr;
+    mappings[num_mappings].len = len;
+    num_mappings++;
+    mapped_bytes += len;
+    update_peak();
+    return addr;
+}
+
+/*
+ * mem_unmap - return a region obtained from mem_map to the system. size
+ *     must be the size it was mapped with.
+ */
+void mem_unmap(void *addr, size_t size) {
+    size_t len = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    int i;
+    for (i = 0; i < num_mappings; i++) {
+        if (mappings[i].addr == addr) {
+            assert(mappings[i].len == len);
+            munmap(addr, len);
+            mapped_bytes -= len;
+            mappings[i] = mappings[--num_mappings];
+            return;
+        }
+    }
+    fprintf(stderr, "ERROR: mem_unmap failed.  %p was not mapped\n", addr);
+}
+
+/*
+ * mem_mapped - return true if lo through hi lies within one region
+ *     obtained from mem_map
+ */
+bool mem_mapped(const void *lo, const void *hi) {
+    int i;
+    for (i = 0; i < num_mappings; i++) {
+        const unsigned char *start = mappings[i].addr;
+        if ((const unsigned char *) lo >= start &&
+            (const unsigned char *) hi < start + mappings[i].len)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * mem_mapped_bytes - return the total size of the regions from mem_map
+ */
+size_t mem_mapped_bytes() {
+    return mapped_bytes;
+}
+
+/*
+ * mem_peak_footprint - return the largest heap size plus mapped bytes seen
+ *     since the heap was last reset
+ */
+size_t mem_peak_footprint() {
+    return peak_footprint;
+}
+
+/*
+ * mem_purge - give back the pages that lie wholly between lo and hi, inside
+ *     the heap, so they read as zero until next written. In huge page mode
+ *     only whole huge pages go. Returns the number of bytes given back.
+ */
+size_t mem_purge(void *lo, void *hi) {
+    size_t page = release_unit();
+    uintptr_t start = align_up((uintptr_t) lo, page);
+    uintptr_t end = (uintptr_t) hi & ~(uintptr_t)(page - 1);
+    if (start >= end)
+        return 0;
+    if (sparse)
+        sparse_zero(start, end);
+    else
+        madvise((void *) start, end - start, MADV_DONTNEED);
+    return end - start;
+}
+
+/*
+ * mem_resident - return how many bytes of the heap and of the mapped
+ *     regions are backed by memory; for a sparse heap, the bytes of the
+ *     pages in its table
+ */
+size_t mem_resident() {
+    size_t bytes = 0;
+    int i;
+    if (sparse)
+        bytes = num_pages * SPARSE_PAGE_SIZE;
+    else
+        bytes = resident_bytes(heap, mem_brk - heap);
+    for (i = 0; i < num_mappings; i++)
+        bytes += resident_bytes(mappings[i].addr, mappings[i].len);
+    return bytes;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -116,6 +325,16 @@ void *mem_heap_hi(){
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_fresh_lo - return the lowest heap address above which nothing has
+ *     been written since the heap was mapped or its pages were released,
+ *     so everything from there up reads as zero. mem_reset_brk does not
+ *     clear the heap, so this stays above memory used by an earlier run.
+ */
+void *mem_fresh_lo(){
+    return (void *) fresh_lo;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -130,9 +349,165 @@ size_t mem_pagesize(){
     return (size_t) sysconf(_SC_PAGESIZE);
 }
 
+/*
+ * mem_granule() - returns the size the heap break should be kept a
+ *     multiple of, so that no huge page is left partly used; 1 outside
+ *     huge page mode
+ */
+size_t mem_granule(){
+    return granule;
+}
+
+/*
+ * mem_huge_pages - select huge page mode for the heaps that mem_init maps
+ *     from now on: 0 off, 1 on, 2 on and faulted in as the heap grows
+ */
+void mem_huge_pages(int mode){
+    huge_mode = mode;
+}
+
 
 /*************** Private Functions *******************/
 
+static void update_peak() {
+    size_t footprint = mem_heapsize() + mapped_bytes;
+    if (footprint > peak_footprint)
+        peak_footprint = footprint;
+}
+
+/* Drop the pages that lie wholly above lo, up to hi; they read as zero again.
+   In huge page mode only whole huge pages go, so none is split. */
+static void release_pages(unsigned char *lo, unsigned char *hi) {
+    size_t page = release_unit();
+    uintptr_t start = align_up((uintptr_t) lo, page);
+    uintptr_t end = align_up((uintptr_t) hi, page);
+    if (start >= end)
+        return;
+    if (sparse)
+        sparse_zero(start, end);
+    else
+        madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* Bytes of the len from addr, a page boundary, that are resident */
+static size_t resident_bytes(unsigned char *addr, size_t len) {
+    size_t page = mem_pagesize();
+    size_t n = (len + page - 1) / page, i, count = 0;
+    unsigned char *vec;
+    if (n == 0 || (vec = malloc(n)) == NULL)
+        return 0;
+    if (mincore(addr, len, vec) == 0)
+        for (i = 0; i < n; i++)
+            count += vec[i] & 1;
+    free(vec);
+    return count * page;
+}
+
+/* Size of the pages release_pages gives back */
+static size_t release_unit() {
+    if (sparse)
+        return SPARSE_PAGE_SIZE;
+    return granule > mem_pagesize() ? granule : mem_pagesize();
+}
+
+/*
+ * Reserve MAX_DENSE_HEAP bytes of address space for the heap, without
+ * access; mem_sbrk makes it accessible COMMIT_STEP bytes at a time
+ */
+static void reserve_heap() {
+    void *addr;
+    mmap_length = MAX_DENSE_HEAP;
+    if (huge_mode)
+        addr = map_huge(mmap_length);
+    else
+        addr = mmap(TRY_DENSE_HEAP_START, mmap_length, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
+        exit(1);
+    }
+
+    dense_heap = addr;
+    committed = dense_heap;
+    reserved_mode = huge_mode;
+}
+
+/* Make the heap accessible up to the next commit step past hi */
+static bool commit(unsigned char *hi) {
+    size_t step = granule > COMMIT_STEP ? granule : COMMIT_STEP;
+    unsigned char *end = (unsigned char *) align_up((uintptr_t) hi, step);
+    if (end > mem_max_addr)
+        end = mem_max_addr;
+    if (mprotect(committed, end - committed, PROT_READ | PROT_WRITE) != 0)
+        return false;
+    committed = end;
+    return true;
+}
+
+/*
+ * Map len bytes, a multiple of HUGE_PAGE_SIZE, on a HUGE_PAGE_SIZE boundary.
+ * hugetlbfs pages are tried first; they must all be set aside up front, so
+ * the mapping fails at once when the system lacks them. Otherwise a
+ * reservation without access is cut down to an aligned range and marked
+ * for transparent huge pages, which the kernel supplies where it can.
+ */
+static void *map_huge(size_t len) {
+    void *addr;
+#ifdef MAP_HUGETLB
+    addr = mmap(TRY_DENSE_HEAP_START, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED)
+        return addr;
+#endif
+    size_t raw_len = len + HUGE_PAGE_SIZE;
+    unsigned char *raw = mmap(TRY_DENSE_HEAP_START, raw_len, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+    if (raw == MAP_FAILED)
+        return MAP_FAILED;
+    unsigned char *start = (unsigned char *)
+        align_up((uintptr_t) raw, HUGE_PAGE_SIZE);
+    if (start > raw)
+        munmap(raw, start - raw);
+    if (start + len < raw + raw_len)
+        munmap(start + len, raw + raw_len - (start + len));
+#ifdef MADV_HUGEPAGE
+    madvise(start, len, MADV_HUGEPAGE);
+#endif
+    return start;
+}
+
+/* Fault in the heap from prefaulted up to the huge page boundary past hi */
+static void prefault(unsigned char *hi) {
+    unsigned char *end = (unsigned char *) align_up((uintptr_t) hi, granule);
+    if (end > mem_max_addr)
+        end = mem_max_addr;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(prefaulted, end - prefaulted, MADV_POPULATE_WRITE) == 0) {
+        prefaulted = end;
+        return;
+    }
+#endif
+    /* Older kernels: write each page's first byte back to itself */
+    size_t page = mem_pagesize();
+    volatile unsigned char *p;
+    for (p = prefaulted; p < end; p += page)
+        *p = *p;
+    prefaulted = end;
+}
+
+static uintptr_t align_up(uintptr_t addr, size_t n) {
+    return (addr + n - 1) & ~(uintptr_t)(n - 1);
+}
+
+static void unmap_all() {
+    while (num_mappings > 0) {
+        num_mappings--;
+        munmap(mappings[num_mappings].addr, mappings[num_mappings].len);
+    }
+    mapped_bytes = 0;
+}
+
 
 static void print_stats() {
     size_t vbytes = mem_heapsize();
@@ -146,6 +521,11 @@ static void print_stats() {
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
 
+    if (in_sparse(addr)) {
+        rdata = 0;
+        sparse_copy_out(&rdata, (uintptr_t) addr, len);
+        return rdata;
+    }
     rdata = *(uint64_t *) addr;
     if (len < sizeof(uint64_t)) {
         uint64_t mask = ((uint64_t) 1 << (8 * len)) - 1;
@@ -156,8 +536,245 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-   if (len == sizeof(uint64_t))
+   if (in_sparse(addr))
+        sparse_copy_in((uintptr_t) addr, &val, len);
+   else if (len == sizeof(uint64_t))
         *(uint64_t *) addr = val;
     else
         memcpy(addr, (void *) &val, len);
 }
+
+/*
+ * mem_memset - memset that also reaches the sparse heap
+ */
+void *mem_memset(void *dest, int c, size_t n) {
+    if (!in_sparse(dest))
+        return memset(dest, c, n);
+    if (c == 0) {
+        sparse_zero((uintptr_t) dest, (uintptr_t) dest + n);
+        return dest;
+    }
+    unsigned char buf[SPARSE_PAGE_SIZE];
+    memset(buf, c, sizeof(buf));
+    uintptr_t p = (uintptr_t) dest;
+    while (n > 0) {
+        size_t len = SPARSE_PAGE_SIZE - p % SPARSE_PAGE_SIZE;
+        if (len > n)
+            len = n;
+        sparse_copy_in(p, buf, len);
+        p += len;
+        n -= len;
+    }
+    return dest;
+}
+
+/*
+ * mem_memcpy - memcpy that also reaches the sparse heap. The regions must
+ *     not overlap.
+ */
+void *mem_memcpy(void *dest, const void *src, size_t n) {
+    bool dest_sparse = in_sparse(dest);
+    bool src_sparse = in_sparse(src);
+    if (!dest_sparse && !src_sparse)
+        return memcpy(dest, src, n);
+    if (dest_sparse && src_sparse && n / SPARSE_PAGE_SIZE > num_pages) {
+        /* Only the pages that exist hold anything but zeros, and there
+           are fewer of them than pages to copy */
+        uintptr_t lo = (uintptr_t) src, hi = lo + n;
+        sparse_page_t **found = malloc(num_pages * sizeof(*found) + 1);
+        size_t nfound = 0, b;
+        sparse_page_t *pg;
+        assert(found != NULL);
+        for (b = 0; b < num_buckets; b++)
+            for (pg = buckets[b]; pg != NULL; pg = pg->next) {
+                uintptr_t base = pg->index * SPARSE_PAGE_SIZE;
+                if (base < hi && base + SPARSE_PAGE_SIZE > lo)
+                    found[nfound++] = pg;
+            }
+        sparse_zero((uintptr_t) dest, (uintptr_t) dest + n);
+        for (b = 0; b < nfound; b++) {
+            uintptr_t base = found[b]->index * SPARSE_PAGE_SIZE;
+            uintptr_t from = base > lo ? base : lo;
+            uintptr_t to = base + SPARSE_PAGE_SIZE < hi ? base + SPARSE_PAGE_SIZE : hi;
+            sparse_copy_in((uintptr_t) dest + (from - lo),
+                           found[b]->data + (from - base), to - from);
+        }
+        free(found);
+        return dest;
+    }
+    unsigned char buf[SPARSE_PAGE_SIZE];
+    uintptr_t d = (uintptr_t) dest, s = (uintptr_t) src;
+    while (n > 0) {
+        size_t len = SPARSE_PAGE_SIZE - s % SPARSE_PAGE_SIZE;
+        if (len > n)
+            len = n;
+        if (src_sparse)
+            sparse_copy_out(buf, s, len);
+        else
+            memcpy(buf, (void *) s, len);
+        if (dest_sparse)
+            sparse_copy_in(d, buf, len);
+        else
+            memcpy((void *) d, buf, len);
+        d += len;
+        s += len;
+        n -= len;
+    }
+    return dest;
+}
+
+
+/*************** Sparse Emulation *******************/
+
+/* Is addr inside the sparse heap? */
+static bool in_sparse(const void *addr) {
+    return sparse && (const unsigned char *) addr >= heap &&
+        (const unsigned char *) addr < mem_max_addr;
+}
+
+static size_t sparse_hash(uintptr_t index) {
+    return (size_t)((index * 0x9E3779B97F4A7C15UL) >> 32) & (num_buckets - 1);
+}
+
+static sparse_page_t *sparse_find(uintptr_t index) {
+    sparse_page_t *pg;
+    if (num_buckets == 0)
+        return NULL;
+    for (pg = buckets[sparse_hash(index)]; pg != NULL; pg = pg->next)
+        if (pg->index == index)
+            return pg;
+    return NULL;
+}
+
+/* Find the page, making a zeroed one if there is none. The table doubles
+   once the pages outnumber the buckets HASH_LOAD times. */
+static sparse_page_t *sparse_get(uintptr_t index) {
+    sparse_page_t *pg = sparse_find(index);
+    if (pg != NULL)
+        return pg;
+    if (num_pages >= HASH_LOAD * num_buckets) {
+        size_t old_buckets = num_buckets, b;
+        sparse_page_t **old = buckets;
+        num_buckets = old_buckets ? 2 * old_buckets : 64;
+        buckets = calloc(num_buckets, sizeof(*buckets));
+        assert(buckets != NULL);
+        for (b = 0; b < old_buckets; b++)
+            while (old[b] != NULL) {
+                pg = old[b];
+                old[b] = pg->next;
+                size_t h = sparse_hash(pg->index);
+                pg->next = buckets[h];
+                buckets[h] = pg;
+            }
+        free(old);
+    }
+    pg = calloc(1, sizeof(*pg));
+    if (pg == NULL) {
+        fprintf(stderr, "FAILURE.  Ran out of memory for sparse heap pages\n");
+        exit(1);
+    }
+    pg->index = index;
+    size_t h = sparse_hash(index);
+    pg->next = buckets[h];
+    buckets[h] = pg;
+    num_pages++;
+    return pg;
+}
+
+/* Make lo up to hi read as zero. Pages it covers wholly are dropped, by a
+   walk of the table when the range spans more pages than there are. */
+static void sparse_zero(uintptr_t lo, uintptr_t hi) {
+    uintptr_t first = lo / SPARSE_PAGE_SIZE;
+    uintptr_t last = (hi - 1) / SPARSE_PAGE_SIZE;
+    if (lo >= hi || num_pages == 0)
+        return;
+    if (last - first >= num_pages) {
+        size_t b;
+        for (b = 0; b < num_buckets; b++) {
+            sparse_page_t **link = &buckets[b];
+            while (*link != NULL) {
+                sparse_page_t *pg = *link;
+                uintptr_t base = pg->index * SPARSE_PAGE_SIZE;
+                if (base >= lo && base + SPARSE_PAGE_SIZE <= hi) {
+                    *link = pg->next;
+                    free(pg);
+                    num_pages--;
+                    continue;
+                }
+                if (base < hi && base + SPARSE_PAGE_SIZE > lo) {
+                    uintptr_t from = base > lo ? base : lo;
+                    uintptr_t to = base + SPARSE_PAGE_SIZE < hi ? base + SPARSE_PAGE_SIZE : hi;
+                    memset(pg->data + (from - base), 0, to - from);
+                }
+                link = &pg->next;
+            }
+        }
+        return;
+    }
+    uintptr_t index;
+    for (index = first; index <= last; index++) {
+        sparse_page_t *pg = sparse_find(index);
+        if (pg == NULL)
+            continue;
+        uintptr_t base = index * SPARSE_PAGE_SIZE;
+        uintptr_t from = base > lo ? base : lo;
+        uintptr_t to = base + SPARSE_PAGE_SIZE < hi ? base + SPARSE_PAGE_SIZE : hi;
+        memset(pg->data + (from - base), 0, to - from);
+    }
+}
+
+/* Drop every page */
+static void sparse_clear() {
+    size_t b;
+    for (b = 0; b < num_buckets; b++)
+        while (buckets[b] != NULL) {
+            sparse_page_t *pg = buckets[b];
+            buckets[b] = pg->next;
+            free(pg);
+        }
+    free(buckets);
+    buckets = NULL;
+    num_buckets = 0;
+    num_pages = 0;
+}
+
+/* Copy n bytes from the sparse heap at src, which may span pages */
+static void sparse_copy_out(void *dest, uintptr_t src, size_t n) {
+    unsigned char *d = dest;
+    while (n > 0) {
+        size_t off = src % SPARSE_PAGE_SIZE;
+        size_t len = SPARSE_PAGE_SIZE - off < n ? SPARSE_PAGE_SIZE - off : n;
+        sparse_page_t *pg = sparse_find(src / SPARSE_PAGE_SIZE);
+        if (pg != NULL)
+            memcpy(d, pg->data + off, len);
+        else
+            memset(d, 0, len);
+        d += len;
+        src += len;
+        n -= len;
+    }
+}
+
+/* Copy n bytes into the sparse heap at dest. Zeros going to a page that
+   does not exist yet need no page. */
+static void sparse_copy_in(uintptr_t dest, const void *src, size_t n) {
+    const unsigned char *s = src;
+    while (n > 0) {
+        size_t off = dest % SPARSE_PAGE_SIZE;
+        size_t len = SPARSE_PAGE_SIZE - off < n ? SPARSE_PAGE_SIZE - off : n;
+        uintptr_t index = dest / SPARSE_PAGE_SIZE;
+        sparse_page_t *pg = sparse_find(index);
+        if (pg == NULL) {
+            size_t i = 0;
+            while (i < len && s[i] == 0)
+                i++;
+            if (i < len)
+                pg = sparse_get(index);
+        }
+        if (pg != NULL)
+            memcpy(pg->data + off, s, len);
+        s += len;
+        dest += len;
+        n -= len;
+    }
+}
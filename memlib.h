@@ -2,14 +2,32 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void mem_init();               
+void mem_init(bool sparse);
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+void *mem_fresh_lo(void);
 size_t mem_pagesize(void);
+/* The heap break should be kept a multiple of this; 1 if any will do */
+size_t mem_granule(void);
+/* Selects huge page mode (see config.h) for the next mem_init */
+void mem_huge_pages(int mode);
+
+/* Page-aligned regions outside the heap, for large blocks */
+void *mem_map(size_t size);
+void mem_unmap(void *addr, size_t size);
+bool mem_mapped(const void *lo, const void *hi);
+size_t mem_mapped_bytes(void);
+size_t mem_peak_footprint(void);
+
+/* Give back the whole pages from lo to hi, inside the heap, so they read as
+   zero until next written; returns how many bytes went */
+size_t mem_purge(void *lo, void *hi);
+/* Bytes of the heap and mapped regions that are backed by memory */
+size_t mem_resident(void);
 
 /* Read len bytes and return value zero-extended to 64 bits */
 /* Require 0 <= len <= 8 */
@@ -18,3 +36,7 @@ uint64_t mem_read(const void *addr, size_t len);
 /* Write lower order len bytes of val to address */
 /* Require 0 <= len <= 8 */
 void mem_write(void *addr, uint64_t val, size_t len);
+
+/* memset and memcpy that also reach the sparse heap */
+void *mem_memset(void *dest, int c, size_t n);
+void *mem_memcpy(void *dest, const void *src, size_t n);
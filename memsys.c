@@ -0,0 +1,199 @@
+/*
+ * memsys.c - the memlib.h interface on real process memory, for building
+ * mm.c as a shared library that replaces malloc in other programs.
+ *
+ * The heap lives in a range of address space reserved without access on
+ * the first request. mem_sbrk opens up pages as the break rises and gives
+ * them back to the system when it falls, so they read as zero again.
+ * mem_map and mem_unmap are plain anonymous mappings. Only the functions
+ * mm.c calls are provided.
+ *
+ * Nothing here may call malloc, and failures are reported through errno
+ * alone, since printing can allocate. mm.c calls mem_sbrk, mem_map and
+ * mem_unmap with its break lock held, so they need no lock of their own.
+ * mem_purge is called under an arena lock only, and touches no state.
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+/* Largest reservation tried; halved until the system grants one */
+#define RESERVE_MAX ((size_t)1 << 40)
+#define RESERVE_MIN ((size_t)1 << 26)
+/* Pages are made accessible this many bytes at a time as the break rises */
+#define COMMIT_STEP ((size_t)1 << 20)
+
+static unsigned char *heap;         /* Start of the reservation */
+static unsigned char *heap_end;     /* End of the reservation */
+static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *committed;    /* Pages below here are accessible */
+static unsigned char *fresh_lo;     /* Heap above here reads as zero */
+static size_t page_size;
+
+static uintptr_t align_up(uintptr_t addr, size_t n);
+
+/*
+ * mem_init - reserve the address space the heap grows into. The largest
+ *     range the system allows, up to RESERVE_MAX, is taken; pages cost
+ *     nothing until mem_sbrk opens them up and they are written. There is
+ *     no sparse heap here, so sparse must be false.
+ */
+void mem_init(bool sparse) {
+    size_t len;
+    void *addr = MAP_FAILED;
+
+    mem_pagesize();
+    for (len = RESERVE_MAX; len >= RESERVE_MIN; len /= 2) {
+        addr = mmap(NULL, len, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr != MAP_FAILED)
+            break;
+    }
+    if (addr == MAP_FAILED)
+        return;     /* mem_sbrk fails with ENOMEM */
+
+    heap = addr;
+    heap_end = heap + len;
+    mem_brk = heap;
+    committed = heap;
+    fresh_lo = heap;
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start address
+ *     of the new area. A negative incr shrinks the heap, and the pages
+ *     wholly above the new break are given back to the system.
+ */
+void *mem_sbrk(intptr_t incr) {
+    unsigned char *old_brk = mem_brk;
+
+    if (heap == NULL ||
+        (incr > 0 && (size_t) incr > (size_t)(heap_end - mem_brk)) ||
+        (incr < 0 && (size_t) -incr > (size_t)(mem_brk - heap))) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+
+    if (incr < 0) {
+        mem_brk += incr;
+        unsigned char *lo = (unsigned char *) align_up((uintptr_t) mem_brk, page_size);
+        unsigned char *hi = fresh_lo > old_brk ? fresh_lo : old_brk;
+        hi = (unsigned char *) align_up((uintptr_t) hi, page_size);
+        if (lo < hi)
+            madvise(lo, hi - lo, MADV_DONTNEED);
+        if (fresh_lo > lo)
+            fresh_lo = lo;
+        return (void *) old_brk;
+    }
+
+    if (mem_brk + incr > committed) {
+        unsigned char *end = (unsigned char *)
+            align_up((uintptr_t)(mem_brk + incr), COMMIT_STEP);
+        if (end > heap_end)
+            end = heap_end;
+        if (mprotect(committed, end - committed, PROT_READ | PROT_WRITE) != 0) {
+            errno = ENOMEM;
+            return (void *) -1;
+        }
+        committed = end;
+    }
+    mem_brk += incr;
+    if (fresh_lo < mem_brk)
+        fresh_lo = mem_brk;
+    return (void *) old_brk;
+}
+
+/*
+ * mem_map - map a fresh, zero-filled region of size bytes outside the heap.
+ *     size is rounded up to whole pages and the region is page aligned.
+ *     Returns (void *) -1 on failure, like mem_sbrk.
+ */
+void *mem_map(size_t size) {
+    void *addr = mmap(NULL, align_up(size, page_size), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        errno = ENOMEM;
+        return (void *) -1;
+    }
+    return addr;
+}
+
+/*
+ * mem_unmap - return a region obtained from mem_map to the system. size
+ *     must be the size it was mapped with.
+ */
+void mem_unmap(void *addr, size_t size) {
+    munmap(addr, align_up(size, page_size));
+}
+
+/*
+ * mem_purge - give back the pages that lie wholly between lo and hi, inside
+ *     the heap, so they read as zero until next written. Returns the
+ *     number of bytes given back.
+ */
+size_t mem_purge(void *lo, void *hi) {
+    uintptr_t start = align_up((uintptr_t) lo, page_size);
+    uintptr_t end = (uintptr_t) hi & ~(uintptr_t)(page_size - 1);
+    if (start >= end)
+        return 0;
+    madvise((void *) start, end - start, MADV_DONTNEED);
+    return end - start;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo() {
+    return (void *) heap;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi() {
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_fresh_lo - return the lowest heap address above which nothing has
+ *     been written since the pages were reserved or given back, so
+ *     everything from there up reads as zero.
+ */
+void *mem_fresh_lo() {
+    return (void *) fresh_lo;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize() {
+    return (size_t)(mem_brk - heap);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize() {
+    if (page_size == 0)
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+
+/*
+ * mem_granule() - returns the size the heap break should be kept a
+ *     multiple of; any break will do here
+ */
+size_t mem_granule() {
+    return 1;
+}
+
+
+/*************** Private Functions *******************/
+
+static uintptr_t align_up(uintptr_t addr, size_t n) {
+    return (addr + n - 1) & ~(uintptr_t)(n - 1);
+}
@@ -0,0 +1,163 @@
+/*
+ * mkclasses.c - Generates mmclasses.h, the free list size classes of mm.c
+ *
+ * Usage: mkclasses <num_seg_lists> <seg_list_factor>
+ *        mkclasses -b <bound>,<bound>,...
+ *
+ * Class 0 holds the 16-byte small blocks. In the first form class 1 starts
+ * at 32 bytes and every class after it covers seg_list_factor octaves, as
+ * the lists always have. The second form lists the smallest block size of
+ * classes 1 and up, so classes need not be powers of two apart. Either way
+ * the last class takes every larger size.
+ *
+ * mm.c finds the class of a block size with one table load: sizes below
+ * class_small_limit index class_small by size / 16, and larger sizes index
+ * class_large by their most significant bit and the three bits below it.
+ * Bounds from class_small_limit up must therefore be a multiple of an
+ * eighth of the power of two below them, which the generator checks.
+ * class_min_has_tree_min compares MM_TREE_MIN with every bound, so a tree
+ * threshold that does not start a class fails the build.
+ *
+ * Build with "make mmclasses.h CLASSES=..."; see the Makefile.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXCLASSES 255      /* classes are stored in unsigned char */
+#define SMALL_LIMIT 1024    /* sizes below this use the direct table */
+#define LARGE_STEPS 8       /* steps per octave in the large table */
+#define SIZE_BITS 64
+
+static size_t bound[MAXCLASSES];
+static int nclasses;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mkclasses <num_seg_lists> <seg_list_factor>\n"
+                    "       mkclasses -b <bound>,<bound>,...\n");
+    exit(1);
+}
+
+static int msb_index(size_t x)
+{
+    return SIZE_BITS - 1 - __builtin_clzl(x);
+}
+
+/* Class of a block size, by a search of the bounds */
+static int class_of(size_t size)
+{
+    int i = nclasses - 1;
+    while (bound[i] > size)
+        i--;
+    return i;
+}
+
+static void parse_bounds(char *list)
+{
+    char *tok;
+    bound[0] = 16;
+    nclasses = 1;
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *end;
+        size_t b = strtoul(tok, &end, 0);
+        if (*end != '\0' || nclasses == MAXCLASSES) {
+            fprintf(stderr, "mkclasses: bad bound %s\n", tok);
+            exit(1);
+        }
+        bound[nclasses++] = b;
+    }
+}
+
+static void factor_bounds(int n, int factor)
+{
+    int i;
+    if (n < 2 || n > MAXCLASSES || factor < 1 ||
+        (long)(n - 2) * factor > SIZE_BITS - 7) {
+        fprintf(stderr, "mkclasses: bad class count or factor\n");
+        exit(1);
+    }
+    bound[0] = 16;
+    for (i = 1; i < n; i++)
+        bound[i] = (size_t)32 << ((i - 1) * factor);
+    nclasses = n;
+}
+
+/* Rejects bounds the tables cannot express */
+static void check_bounds(void)
+{
+    int i;
+    if (nclasses < 2 || bound[1] != 32) {
+        fprintf(stderr, "mkclasses: class 1 must start at 32\n");
+        exit(1);
+    }
+    for (i = 1; i < nclasses; i++) {
+        size_t b = bound[i];
+        if (b <= bound[i-1] || b % 16 != 0) {
+            fprintf(stderr, "mkclasses: bound %zu is not a multiple of 16 "
+                    "above the one before\n", b);
+            exit(1);
+        }
+        if (b >= SMALL_LIMIT &&
+            b % ((size_t)1 << (msb_index(b) - 3)) != 0) {
+            fprintf(stderr, "mkclasses: bound %zu is not a multiple of "
+                    "%zu\n", b, (size_t)1 << (msb_index(b) - 3));
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i, j;
+
+    if (argc == 3 && strcmp(argv[1], "-b") == 0)
+        parse_bounds(argv[2]);
+    else if (argc == 3)
+        factor_bounds(atoi(argv[1]), atoi(argv[2]));
+    else
+        usage();
+    check_bounds();
+
+    printf("/* Generated by mkclasses from the Makefile's CLASSES; "
+           "do not edit */\n\n");
+    printf("#define num_seg_lists %d\n\n", nclasses);
+
+    printf("/* Smallest block size of each class */\n");
+    printf("static const size_t class_min[num_seg_lists] = {");
+    for (i = 0; i < nclasses; i++)
+        printf("%s%s%zu", i ? "," : "", i % 6 ? " " : "\n    ", bound[i]);
+    printf("\n};\n\n");
+
+    /* the preprocessor cannot read class_min, so mm.c checks this instead */
+    printf("/* True if MM_TREE_MIN starts a class, for a build time check */\n");
+    printf("#define class_min_has_tree_min \\\n    (");
+    for (i = 1; i < nclasses; i++)
+        printf("%sMM_TREE_MIN == %zu", i == 1 ? "" :
+               (i - 1) % 3 ? " || " : " || \\\n     ", bound[i]);
+    printf(")\n\n");
+
+    printf("/* Class of each size below class_small_limit, by size / 16 */\n");
+    printf("static const size_t class_small_limit = %d;\n", SMALL_LIMIT);
+    printf("static const unsigned char class_small[%d] = {", SMALL_LIMIT / 16);
+    for (i = 0; i < SMALL_LIMIT / 16; i++)
+        printf("%s%s%d", i ? "," : "", i % 16 ? " " : "\n    ",
+               i ? class_of((size_t)i * 16) : 0);
+    printf("\n};\n\n");
+
+    printf("/* Class of larger sizes, by msb * %d and the next bits down */\n",
+           LARGE_STEPS);
+    printf("static const unsigned char class_large[%d] = {",
+           SIZE_BITS * LARGE_STEPS);
+    for (i = 0; i < SIZE_BITS; i++) {
+        printf(i ? ",\n    " : "\n    ");
+        for (j = 0; j < LARGE_STEPS; j++) {
+            int c = 0;
+            if (((size_t)1 << i) >= SMALL_LIMIT)
+                c = class_of(((size_t)1 << i) + ((size_t)j << (i - 3)));
+            printf("%s%d", j ? ", " : "", c);
+        }
+    }
+    printf("\n};\n");
+    return 0;
+}
@@ -42,10 +42,87 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+
+/*
+ * MM_THREADS makes the allocator safe to call from several threads: all
+ * heap state is protected by heap_mutex. MM_TCACHE (on by default with
+ * MM_THREADS) puts a per-thread cache of small blocks in front of the lock.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+
+#ifndef MM_TCACHE
+#define MM_TCACHE MM_THREADS
+#endif
+
+#if MM_TCACHE && !MM_THREADS
+#error "MM_TCACHE requires MM_THREADS"
+#endif
+
+/*
+ * MM_ARENAS is the number of independent heaps. Each arena has its own free
+ * lists and lock and grows through its own chunks of the memlib heap, and
+ * threads are spread over the arenas. The owning arena of a block is kept
+ * in the top byte of its header.
+ */
+#ifndef MM_ARENAS
+#define MM_ARENAS 1
+#endif
+
+#if MM_ARENAS > 1 && !MM_THREADS
+#error "MM_ARENAS > 1 requires MM_THREADS"
+#endif
+
+#if MM_ARENAS > 256
+#error "MM_ARENAS must fit in the header's arena byte"
+#endif
+
+/*
+ * MM_REMOTE_FREE gives each arena a lock-free queue of blocks freed by
+ * threads that allocate from another arena. Such a free pushes the block
+ * with one compare-and-swap instead of taking the owner's lock, and the
+ * owner frees the whole queue under its lock on its next malloc or free.
+ * An arena no thread allocates from any more is not queued to: frees take
+ * its lock and empty the queue, as does the last thread to leave it.
+ */
+#ifndef MM_REMOTE_FREE
+#define MM_REMOTE_FREE 0
+#endif
+
+#if MM_REMOTE_FREE && MM_ARENAS < 2
+#error "MM_REMOTE_FREE requires MM_ARENAS > 1"
+#endif
+
+/*
+ * SPARSE_MODE builds the allocator for mdriver-sparse, whose heap memlib
+ * emulates with a table of pages made on first touch, so traces can ask
+ * for terabytes. That heap cannot be dereferenced: every heap word goes
+ * through read_word and write_word, and memset and memcpy through memlib.
+ * Only the base allocator is converted, and large blocks stay in the heap.
+ */
+#ifndef SPARSE_MODE
+#define SPARSE_MODE 0
+#endif
+
+#if SPARSE_MODE && MM_THREADS
+#error "SPARSE_MODE cannot be used with MM_THREADS"
+#endif
+
+#if SPARSE_MODE
+#define memset mem_memset
+#define memcpy mem_memcpy
+#endif
+
+#if MM_THREADS || !defined(DRIVER)
+#include <pthread.h>
+#endif
 
 #ifdef DRIVER
 /* create aliases for driver tests */
@@ -53,6 +130,13 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define reallocarray mm_reallocarray
+#define malloc_usable_size mm_malloc_usable_size
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
@@ -83,35 +167,303 @@ typedef uint64_t word_t;
 static const size_t wsize = sizeof(word_t);   // word and header size (bytes)
 static const size_t dsize = 2*sizeof(word_t);       // double word size (bytes)
 static const size_t min_block_size = 2*sizeof(word_t); // Minimum block size
-static const size_t min_lblock_size = 4*sizeof(word_t); // Minimum normal block size
 static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
+static const size_t batch_sort_min = 32;      // longer free batches use qsort
 
 static const word_t alloc_mask = 0x1;      // denotes if the block is allocated
 static const word_t prev_alloc_mask = 0x2; // denotes if the prev block is alloc
 static const word_t sblock_mask = 0x4;     // denotes if the block is small
 static const word_t prev_sblock_mask = 0x8;// denotes if the prev block is small
+#if MM_ARENAS > 1
+static const int arena_shift = 56;         // arena index lives in the top byte
+static const word_t arena_mask = (word_t)0xFF << 56;
+static const word_t size_mask = ~(word_t)0xF & ~((word_t)0xFF << 56);
+#else
+static const word_t arena_mask = 0;
 static const word_t size_mask = ~(word_t)0xF;
+#endif
+
+/*
+ * Requests of at least MM_MMAP_THRESHOLD bytes get a region of their own
+ * from mem_map instead of a block in the heap, and free hands the region
+ * back to the system. A mapped block has the usual header, one word into
+ * its region, and is told apart from heap blocks by its address. Setting
+ * the threshold to 0 keeps every block in the heap.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#if SPARSE_MODE
+#define MM_MMAP_THRESHOLD 0
+#else
+#define MM_MMAP_THRESHOLD (1 << 20)
+#endif
+#endif
+
+/*
+ * When a free leaves a block of more than MM_TRIM_THRESHOLD bytes at the top
+ * of the heap, all but MM_TRIM_THRESHOLD / 2 bytes of it are handed back to
+ * memlib by lowering the break. If the arena has to extend the heap again
+ * before its next trim, the trim gave back memory that was still needed, so
+ * the size of that extension is added to both the threshold and the bytes
+ * kept, up to trim_extra_max. The default of 0 never trims: a trace that
+ * frees its whole heap and builds it again faults every page back in.
+ */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD 0
+#endif
+
+/*
+ * With MM_PURGE_DECAY set, a free block of at least MM_PURGE_MIN bytes that
+ * stays in the free lists for MM_PURGE_DECAY operations on its arena has
+ * the whole pages inside it handed back through mem_purge. Its header,
+ * links and footer stay put, and the pages fault back in, reading as zero,
+ * when the block is used again. Setting the decay to 0 never purges.
+ */
+#ifndef MM_PURGE_DECAY
+#define MM_PURGE_DECAY 0
+#endif
 
+#ifndef MM_PURGE_MIN
+#define MM_PURGE_MIN (64 << 10)
+#endif
+
+/*
+ * MM_TLSF selects the two-level segregated fit engine. The free lists are
+ * indexed by (first level, second level): the first level is the power of
+ * two of the size, the second level splits that power of two into
+ * tlsf_sl_count linear classes. A bitmap per level records which lists are
+ * non-empty, so both find_list and find_fit are constant time.
+ */
+#ifndef MM_TLSF
+#define MM_TLSF 0
+#endif
+
+#if MM_TLSF
+#define tlsf_sl_log2 4
+#define tlsf_sl_count (1 << tlsf_sl_log2)
+#define tlsf_fl_count 32
+#define num_seg_lists (tlsf_fl_count * tlsf_sl_count)
+// Sizes below this share first level 0 with dsize spacing
+static const size_t tlsf_small_size = (size_t)1 << (tlsf_sl_log2 + 4);
+#else
 static const int num_candidates = 1; // Number of candidates for Nth fit
-// static const int num_seg_lists = 15;
-#define num_seg_lists 15
-static const int seg_list_factor = 1;
+/*
+ * num_seg_lists and the tables find_list reads come from mmclasses.h, which
+ * mkclasses generates from the Makefile's CLASSES
+ */
+#include "mmclasses.h"
+#endif
+
+/*
+ * MM_COMPACT_LINKS stores free list links as 32-bit offsets from the start
+ * of the heap in units of dsize, which reaches 64 GB of heap. Both links
+ * then fit in the first payload word, so a 16-byte free block is an
+ * ordinary list member instead of keeping its prev link in its header.
+ */
+#ifndef MM_COMPACT_LINKS
+#define MM_COMPACT_LINKS 0
+#endif
+
+/*
+ * MM_FASTBINS parks freed blocks of up to fastbin_max_size bytes in per-size
+ * LIFO bins of their arena without coalescing them, and later requests of
+ * the same size take them straight back. Binned blocks stay marked
+ * allocated, so they neither coalesce nor appear in the free lists. When a
+ * request finds no fit, the bins are consolidated into the free lists
+ * before the heap is extended.
+ */
+#ifndef MM_FASTBINS
+#define MM_FASTBINS 0
+#endif
+
+#if MM_FASTBINS
+#define fastbin_count 8
+static const size_t fastbin_max_size = fastbin_count * 2*sizeof(word_t);
+#endif
+
+/*
+ * MM_TREE indexes free blocks of MM_TREE_MIN bytes or more in a size
+ * ordered search tree per arena instead of the top segregated lists, so
+ * large requests get a best fit in O(log n). The tree is a treap keyed by
+ * (size, address) whose priorities are a hash of the block address, so a
+ * node only needs its two child links, which live where the list links of
+ * a free block would.
+ */
+#ifndef MM_TREE
+#define MM_TREE 0
+#endif
+
+#ifndef MM_TREE_MIN
+#define MM_TREE_MIN 1024
+#endif
+
+#if MM_TREE && MM_TLSF
+#error "MM_TREE replaces the segregated lists and cannot be used with MM_TLSF"
+#endif
+
+// the lists stop where the tree starts, so MM_TREE_MIN must start a class
+#if MM_TREE && !class_min_has_tree_min
+#error "MM_TREE_MIN must be one of the class bounds set by CLASSES"
+#endif
+
+/*
+ * MM_PREFETCH makes find_fit prefetch the free block MM_PREFETCH (1 or 2)
+ * links ahead of the one it is looking at, so the next hop of a list walk
+ * is already on its way from memory.
+ */
+#ifndef MM_PREFETCH
+#define MM_PREFETCH 0
+#endif
+
+#if MM_PREFETCH < 0 || MM_PREFETCH > 2
+#error "MM_PREFETCH must be 0, 1 or 2"
+#endif
+
+/*
+ * MM_FIT_CACHE keeps, for each list from fit_cache_first up, the sizes and
+ * addresses of its first fit_cache_slots blocks in list order, inside the
+ * arena. find_fit checks those sizes without touching the blocks and only
+ * follows links past the cached prefix, so it picks the same block as
+ * without the cache.
+ */
+#ifndef MM_FIT_CACHE
+#define MM_FIT_CACHE 0
+#endif
+
+#if MM_FIT_CACHE && MM_TLSF
+#error "MM_FIT_CACHE is for the segregated lists and cannot be used with MM_TLSF"
+#endif
+
+#if MM_FIT_CACHE
+#define fit_cache_slots 8
+// The list holding 512-byte blocks and those above it
+#define fit_cache_first find_list(512)
+#endif
+
+/*
+ * MM_SLAB serves requests of up to slab_max_size bytes from slab runs: page
+ * sized, page aligned heap blocks split into equal slots of one size class,
+ * with no header per object. A bitmap at the start of each run marks the
+ * slots in use, and allocation takes the first clear bit. A second bitmap,
+ * over the pages of the heap, marks the pages that are runs so that free can
+ * tell a slot from an ordinary block.
+ */
+#ifndef MM_SLAB
+#define MM_SLAB 0
+#endif
+
+#if MM_SLAB
+#define slab_classes 4
+#define slab_map_words 4
+static const size_t slab_max_size = slab_classes * 2*sizeof(word_t);
+// Block size and payload alignment of a run. The header sits in the last
+// word of the previous page, so runs placed back to back tile the heap.
+static const size_t slab_run_size = 1 << 12;
+static const size_t slab_slot_offset = 64;   // sizeof(slab_run_t), rounded up
+// Number of heap pages covered by the page map (memlib's 100 MB heap)
+#define slab_page_count ((100 << 20) >> 12)
+
+typedef struct slab_run {
+    /* Links in the arena's list of runs with free slots */
+    struct slab_run *next;
+    struct slab_run *prev;
+    uint32_t slot_size;
+    uint16_t nslots;
+    uint16_t nfree;
+    /* Bit i set if slot i is in use; bits past nslots are always set */
+    word_t bitmap[slab_map_words];
+} slab_run_t;
+#endif
+
+/*
+ * MM_STATS keeps counters of requests, fit searches, placements, coalescing
+ * and heap growth in each arena, which mm_stats adds up together with a
+ * census of the free lists. Without it the counting calls compile to
+ * nothing and mm_stats returns false.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
+/*
+ * MM_STATS_CYCLES also times each find_fit with the time stamp counter.
+ * Reading it twice costs more than most searches, so it is a separate
+ * option, and the cycle counter stays 0 without it.
+ */
+#ifndef MM_STATS_CYCLES
+#define MM_STATS_CYCLES 0
+#endif
+
+#if SPARSE_MODE && (MM_TLSF || MM_COMPACT_LINKS || MM_FASTBINS || MM_TREE || \
+                    MM_FIT_CACHE || MM_SLAB || MM_MMAP_THRESHOLD > 0)
+#error "SPARSE_MODE supports only the base allocator, without mapped blocks"
+#endif
+
+#if MM_PURGE_DECAY > 0 && MM_PURGE_MIN < 64
+#error "MM_PURGE_MIN must leave room for the links and the purge tag"
+#endif
+
+#if MM_STATS && num_seg_lists > MM_STATS_CLASSES
+#error "MM_STATS_CLASSES must cover every free list"
+#endif
+
+#if MM_STATS_CYCLES && !MM_STATS
+#error "MM_STATS_CYCLES needs MM_STATS"
+#endif
+
+// Counters of an arena, in the order of the mm_stats_t fields
+typedef enum {
+    stat_mallocs,
+    stat_frees,
+    stat_reallocs,
+    stat_fit_searches,
+    stat_fit_candidates,
+    stat_splits,
+    stat_exact_fits,
+    stat_coalesce_none,
+    stat_coalesce_next,
+    stat_coalesce_prev,
+    stat_coalesce_both,
+    stat_heap_extends,
+    stat_heap_trims,
+    stat_fit_cycles,
+    stat_purges,
+    stat_purged_bytes,
+    stat_remote_frees,
+    stat_count
+} stat_t;
 
 // forward declarations
 struct block;
 typedef struct block block_t;
 
+// Free list link: a pointer, or a heap offset with MM_COMPACT_LINKS
+#if MM_COMPACT_LINKS
+typedef uint32_t link_t;
+#else
+typedef block_t *link_t;
+#endif
+
 // List node struct to make list operations more readable
 typedef struct ListNode {
-    block_t* next;
-    block_t* prev;
+    link_t next;
+    link_t prev;
 } node_t;
 
+// Search tree node, for free blocks indexed by the size tree
+typedef struct TreeNode {
+    block_t* left;
+    block_t* right;
+} tnode_t;
+
 typedef union Payload {
     /* Payload can be one of two things: data (if allocated) */
     char data[0];
     /* or a list node (if free) */
     node_t list_node;
+    /* or a tree node (if free and indexed by the size tree) */
+    tnode_t tree_node;
+    /* or the next block in a fast bin or thread cache (if parked) */
+    block_t *parked_next;
 } payload_t;
 
 struct block
@@ -130,26 +482,341 @@ struct block
      */
 };
 
+#if MM_FIT_CACHE
+/*
+ * Cached prefix of a free list: the sizes and addresses of its first count
+ * blocks, in list order. Sizes are kept apart from addresses so a scan of
+ * them reads one cache line. The whole list is cached when count equals
+ * length.
+ */
+typedef struct {
+    size_t size[fit_cache_slots];
+    block_t *block[fit_cache_slots];
+    unsigned int count;   // blocks cached
+    unsigned long length; // blocks in the list
+} fit_cache_t;
+#endif
+
+#if MM_PURGE_DECAY > 0
+/*
+ * Purge tag: the words before the footer of a free block of at least
+ * MM_PURGE_MIN bytes. They link the block into its arena's purge queue and
+ * hold the arena clock when the block was freed, or purge_done once its
+ * pages have been purged and it has left the queue.
+ */
+typedef struct {
+    block_t *next;
+    block_t *prev;
+    word_t stamp;
+} purge_tag_t;
+static const word_t purge_done = ~(word_t)0;
+#endif
+
+/*
+ * An arena is a set of free lists together with the lock protecting them.
+ * Its blocks live in chunks of the heap bounded by a prologue footer and an
+ * epilogue header, so coalescing never crosses into another arena.
+ */
+typedef struct {
+    /* Pointer to free blocks*/
+    block_t* free_ptr_list[num_seg_lists];
+#if MM_TLSF
+    /* Bit i set if any list in first level i is non-empty */
+    word_t tlsf_fl_bitmap;
+    /* Bit j of entry i set if free_ptr_list[i*tlsf_sl_count + j] is non-empty */
+    uint32_t tlsf_sl_bitmap[tlsf_fl_count];
+#endif
+    /* Epilogue of the arena's most recent chunk, NULL before the first */
+    block_t *epilogue;
+#if MM_TREE
+    /* Root of the size tree of large free blocks */
+    block_t *tree_root;
+#endif
+#if MM_FASTBINS
+    /* Freed small blocks awaiting reuse or consolidation, per block size */
+    block_t *fastbin[fastbin_count];
+    /* Bit i set if fastbin[i] is non-empty */
+    unsigned int fastbin_map;
+#endif
+#if MM_SLAB
+    /* Runs with at least one free slot, per size class */
+    slab_run_t *slab_partial[slab_classes];
+#endif
+#if MM_THREADS
+    pthread_mutex_t mutex;
+    /* Number of times a thread had to wait for mutex */
+    unsigned long contention;
+#endif
+#if MM_STATS
+    /* Counters for mm_stats, indexed by stat_t */
+    unsigned long stats[stat_count];
+#endif
+#if MM_FIT_CACHE
+    /* Cached prefix of each list, for find_fit */
+    fit_cache_t fit_cache[num_seg_lists];
+#endif
+#if MM_REMOTE_FREE
+    /* Blocks other arenas' threads freed, linked through parked_next and
+       pushed without the lock; newest first */
+    block_t *remote_head;
+    /* Threads that allocate from the arena; 0 or less if none do */
+    int users;
+#endif
+#if MM_PURGE_DECAY > 0
+    /* Free blocks awaiting a purge, in the order they were freed */
+    block_t *purge_head;
+    block_t *purge_tail;
+    /* Operations on the arena so far, the clock the decay is counted in */
+    unsigned long purge_clock;
+#endif
+#if MM_TRIM_THRESHOLD > 0
+    /* Added to the trim threshold and pad after trims that were undone */
+    size_t trim_extra;
+    /* Set by a trim, cleared by the next extension of the heap */
+    bool trimmed;
+#endif
+} arena_t;
 
 /* Global variables */
 /* Pointer to first block */
 static block_t *heap_start = NULL;
-/* Pointer to free blocks*/
-static block_t* free_ptr_list[num_seg_lists];
+static arena_t arenas[MM_ARENAS];
+/* Incremented by mm_init so caches can tell they refer to an old heap */
+static unsigned long heap_epoch = 0;
+/*
+ * Zero frontier: heap memory at or above it has never been handed out, so
+ * it reads as zero apart from the header, links and footer of the free
+ * block it lies in. place() raises it past every block it allocates, and
+ * calloc only clears what lies below it.
+ */
+static char *zero_frontier = NULL;
+#if MM_COMPACT_LINKS
+/* Address compact links are offsets from, the start of the heap */
+static char *link_base = NULL;
+/* Heap size compact links can reach; memsys's heap could grow past it */
+static const size_t link_reach = (size_t)1 << 36;
+#endif
+#if MM_THREADS
+/* Protects the memlib break, which all arenas grow */
+static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#ifndef DRIVER
+/* Sets up memsys and the heap on the first request of the process */
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+#endif
+#if MM_SLAB
+/* Bit i set if heap page i is a slab run */
+static word_t slab_pages[slab_page_count / 64];
+#endif
+/*
+ * Heap checker marks: bit i is set while the block whose header lies in
+ * dsize unit i of the heap has been seen in a free list but not yet in the
+ * heap walk. Covers memlib's dense heap of MAX_DENSE_HEAP bytes; free
+ * blocks above that are looked up in their list instead.
+ */
+#define check_mark_words (MAX_DENSE_HEAP / (16 * 64))
+static word_t check_marks[check_mark_words];
+/* Block mm_checkheap_slice resumes from, NULL for the start of the heap */
+static block_t *check_cursor = NULL;
+#if MM_ARENAS > 1
+/* Arena the calling thread allocates from, assigned round-robin */
+static __thread arena_t *thread_arena;
+static unsigned int next_arena = 0;
+#endif
+#if MM_REMOTE_FREE
+/* Key whose destructor takes an exiting thread out of its arena */
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+#if MM_TCACHE
+/*
+ * Thread cache: per-thread LIFO stacks of free blocks, one per block size up
+ * to tcache_max_size. Cached blocks stay marked allocated in the heap and
+ * are linked through the first payload word, so the shared lists never see
+ * them. A miss refills tcache_batch blocks under one lock acquisition; a
+ * full bin flushes tcache_batch blocks back the same way.
+ */
+#define tcache_bins 32
+static const size_t tcache_max_size = tcache_bins * 2*sizeof(word_t);
+static const unsigned int tcache_max_count = 16;
+static const unsigned int tcache_batch = 8;
+
+typedef struct {
+    block_t *head[tcache_bins];
+    unsigned int count[tcache_bins];
+    unsigned long epoch; // heap_epoch the cached blocks belong to
+} tcache_t;
+
+static __thread tcache_t tcache;
+/* Key whose destructor hands an exiting thread's cache back to the heap */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+/*
+ * Regions: bump allocators over chunks taken from the heap with malloc.
+ * Requests are cut from the current chunk until it runs out; each chunk
+ * starts with a link to the one taken before it, so a reset frees them all
+ * in one walk, keeping only the current chunk for the next phase. Chunk
+ * sizes double from region_chunk_min to region_chunk_max, and a request
+ * larger than a quarter of the next chunk gets a chunk of its own, leaving
+ * the current chunk in use. The chunk headers are plain loads and stores,
+ * so a SPARSE_MODE build makes no regions.
+ */
+static const size_t region_chunk_min = 1 << 12;
+static const size_t region_chunk_max = 1 << 18;
+
+typedef struct region_chunk {
+    struct region_chunk *prev;  // chunk taken before this one
+    size_t size;                // bytes in the chunk, this header included
+} region_chunk_t;
+
+struct mm_region {
+    region_chunk_t *chunks;     // every chunk, newest first
+    region_chunk_t *current;    // chunk requests are cut from
+    char *next;                 // first free byte of the current chunk
+    char *end;                  // end of the current chunk
+    size_t chunk_size;          // size of the next chunk to take
+};
 
 bool mm_checkheap(int lineno);
+static bool check_block(block_t *block, bool chunk_start, int line);
+static block_t *check_next(block_t *block);
+static bool mark_listed(block_t *block);
+static bool take_mark(block_t *block, block_t *free_ptr);
+static void forget_blocks(block_t *lo, block_t *hi);
 static bool in_list(block_t* block, block_t* free_ptr);
+static bool check_free_size(void *bp, size_t size, int line);
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
+static bool heap_init(void);
+#ifndef DRIVER
+static void process_init(void);
+#if MM_THREADS
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+#endif
+#endif
+static block_t *alloc_block(arena_t *arena, size_t asize, size_t *dirty);
+static block_t *fit_or_extend(arena_t *arena, size_t asize);
+static void release_block(block_t *block);
+static void release_locked(block_t *block);
+#if MM_REMOTE_FREE
+static void remote_push(arena_t *arena, block_t *block);
+static void remote_drain(arena_t *arena);
+static bool is_remote(arena_t *arena);
+static void arena_key_create(void);
+static void arena_exit(void *arg);
+#endif
+static block_t *extend_to_fit(arena_t *arena, size_t asize);
+static size_t carve_blocks(block_t *block, size_t asize, size_t n, void **out);
+static bool frees_to_lists(void *bp);
+static int compare_addr(const void *a, const void *b);
+static void *region_grow(mm_region_t *region, size_t asize);
+static block_t *alloc_aligned_block(arena_t *arena, size_t align, size_t asize);
+static block_t *extend_aligned(arena_t *arena, size_t align, size_t asize);
+static bool aligned_fit(block_t *block, size_t align, size_t asize);
+static block_t *top_block(arena_t *arena);
+static void shrink_block(block_t *block, size_t asize);
+static bool resize_in_place(void *bp, size_t size);
+static bool grow_block(arena_t *arena, block_t *block, size_t asize);
+static void free_block(block_t *block);
+#if MM_TRIM_THRESHOLD > 0
+// free space left at the top of the heap after a trim, before trim_extra
+static const size_t trim_pad = MM_TRIM_THRESHOLD / 2;
+// largest trim_extra, so a burst of huge blocks does not pin the heap
+static const size_t trim_extra_max = (size_t)MM_TRIM_THRESHOLD << 8;
+static void trim_heap(block_t *block);
+#endif
+#if MM_MMAP_THRESHOLD > 0
+static void *map_block(size_t size, size_t align);
+static void unmap_block(block_t *block);
+static bool is_mapped(void *bp);
+#endif
+static arena_t *thread_arena_get(void);
+#if MM_ARENAS > 1
+static arena_t *thread_arena_set(arena_t *arena);
+#endif
+static bool lock_arena(arena_t *arena);
+static void unlock_arena(arena_t *arena);
+static void lock_sbrk(void);
+static void unlock_sbrk(void);
+static void count_stat(arena_t *arena, stat_t stat, unsigned long n);
+static void count_call(stat_t stat, unsigned long n);
+#if MM_STATS && MM_TREE
+static void stats_tree(block_t *root, mm_stats_t *stats);
+#endif
+#if MM_FASTBINS
+static block_t *fastbin_pop(arena_t *arena, size_t asize);
+static void fastbin_push(arena_t *arena, block_t *block);
+static bool fastbin_consolidate(arena_t *arena);
+#endif
+#if MM_TCACHE
+static void *tcache_malloc(size_t asize);
+static void tcache_free(block_t *block, size_t size);
+static tcache_t *tcache_get(void);
+static void tcache_flush(tcache_t *tc, int bin, unsigned int n);
+static void tcache_key_create(void);
+static void tcache_exit(void *arg);
+#endif
+#if MM_SLAB
+static void *slab_malloc(arena_t *arena, size_t size);
+static void slab_free(slab_run_t *run, void *bp);
+static void slab_release(arena_t *arena, slab_run_t *run);
+static slab_run_t *slab_new_run(arena_t *arena, int cls);
+static slab_run_t *slab_find_run(void *bp);
+static void slab_mark_page(slab_run_t *run, bool is_run);
+static void slab_push(arena_t *arena, slab_run_t *run);
+static void slab_unlink(arena_t *arena, slab_run_t *run);
+static bool slab_check_run(slab_run_t *run, int line);
+#endif
+static block_t *extend_heap(arena_t *arena, size_t size);
 static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
+static size_t dirty_bytes(block_t *block);
+static void raise_zero_frontier(block_t *block);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static block_t *search_fit(arena_t *arena, size_t asize);
+#if !MM_TLSF
+static bool fit_candidate(block_t *block, size_t size, size_t asize,
+                          block_t **best_block, size_t *min_size, int *num_read);
+#endif
+static unsigned long read_cycles(void);
+#if MM_FIT_CACHE
+static void fit_cache_add(arena_t *arena, int seg_index, block_t *block);
+static void fit_cache_remove(arena_t *arena, int seg_index, block_t *block);
+#endif
 static block_t *coalesce(block_t *block);
+#if MM_PURGE_DECAY > 0
+static purge_tag_t *purge_tag(block_t *block);
+static void purge_enqueue(arena_t *arena, block_t *block);
+static void purge_dequeue(arena_t *arena, block_t *block);
+static void purge_unlink(arena_t *arena, purge_tag_t *tag);
+static void purge_tick(arena_t *arena);
+#endif
 
 static int add_free_block(block_t *block);
 static void remove_block(block_t *block);
 static void initialize_list(block_t* block, int seg_index);
 static int find_list(size_t size);
+#if MM_TLSF
+static block_t *tlsf_find_fit(arena_t *arena, size_t asize);
+static void tlsf_set_bit(arena_t *arena, int seg_index);
+static void tlsf_clear_bit(arena_t *arena, int seg_index);
+#endif
+static int msb_index(size_t x);
+#if MM_TREE
+static bool in_tree(size_t size);
+static void tree_insert(arena_t *arena, block_t *block);
+static void tree_remove(arena_t *arena, block_t *block);
+static block_t *tree_find_fit(arena_t *arena, size_t asize);
+static bool tree_less(block_t *a, block_t *b);
+static word_t tree_priority(block_t *block);
+static bool tree_contains(arena_t *arena, block_t *block);
+static long tree_check(block_t *root, block_t *lo, block_t *hi,
+                       arena_t *arena, int line);
+#endif
 
 static size_t max(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
@@ -173,6 +840,8 @@ static void write_header(block_t *block, size_t size, bool alloc);
 static void write_footer(block_t *block, size_t size, bool alloc);
 static void update_prev_alloc(block_t *block, bool prev_alloc);
 static void update_prev_sblock(block_t *block, bool prev_sblock);
+static arena_t *get_arena(block_t *block);
+static void write_arena(block_t *block, arena_t *arena);
 
 static block_t *payload_to_header(void *bp);
 static void *header_to_payload(block_t *block);
@@ -180,9 +849,16 @@ static void *header_to_payload(block_t *block);
 static block_t *find_next(block_t *block);
 static block_t *find_next_free(block_t *block);
 static word_t *find_prev_footer(block_t *block);
+static word_t read_word(const void *addr);
+static void write_word(void *addr, word_t val);
+static link_t read_link(const link_t *addr);
+static void write_link(link_t *addr, link_t link);
 static block_t *find_prev(block_t *block);
 static block_t *find_prev_ptr(block_t *block);
 static void write_prev_ptr(block_t* block, block_t* prev);
+static void write_next_ptr(block_t* block, block_t* next);
+static block_t *link_to_block(link_t link);
+static link_t block_to_link(block_t *block);
 
 
 /*
@@ -192,6 +868,9 @@ static void write_prev_ptr(block_t* block, block_t* prev);
 bool mm_init(void)
 {
     int i;
+    // memlib does not clear the heap between runs
+    zero_frontier = mem_fresh_lo();
+
     // Create the initial empty heap
     word_t *start = (word_t *)(mem_sbrk(2*wsize));
 
@@ -200,26 +879,129 @@ bool mm_init(void)
         return false;
     }
 
+#if MM_COMPACT_LINKS
+    link_base = (char *)start;
+#endif
+
     // Prologue footer's prev_alloc field does not matter
-    start[0] = pack(0, true, false, false, false); // Prologue footer
-    start[1] = pack(0, true, true, false, false); // Epilogue header
-    // Heap starts with first "block header", currently the epilogue footer
-    heap_start = (block_t *) &(start[1]);
+    write_word(&start[0], pack(0, true, false, false, false)); // Prologue footer
+    write_word(&start[1], pack(0, true, true, false, false)); // Epilogue header
+    ++heap_epoch;
+    check_cursor = NULL;
 
-    for(i=0; i<num_seg_lists; ++i)
+    for(i=0; i<MM_ARENAS; ++i)
     {
-        free_ptr_list[i]=NULL;
+        // clears the free lists; other arenas get a chunk on first use
+        memset(&arenas[i], 0, sizeof(arena_t));
+#if MM_THREADS
+        pthread_mutex_init(&arenas[i].mutex, NULL);
+#endif
     }
+    arenas[0].epilogue = (block_t *) &(start[1]);
+#if MM_SLAB
+    memset(slab_pages, 0, sizeof(slab_pages));
+#endif
 
     // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL)
+    if (extend_heap(&arenas[0], chunksize) == NULL)
     {
         return false;
     }
 
+    // Heap starts with first "block header", currently the epilogue footer.
+    // Set last, so a thread that finds it set sees the arenas ready.
+    __atomic_store_n(&heap_start, (block_t *) &(start[1]), __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * heap_init: Initializes the heap on the first request. The driver calls
+ *            mm_init itself before each trace; a process using the
+ *            allocator as its malloc sets up memsys and the heap exactly
+ *            once, however many threads race to make the first request.
+ *            Returns false if the heap could not be created.
+ */
+static bool heap_init(void)
+{
+    if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) != NULL)
+    {
+        return true;
+    }
+#ifdef DRIVER
+    mm_init();
+#else
+    pthread_once(&heap_once, process_init);
+#endif
+    if (heap_start == NULL)
+    {
+        errno = ENOMEM;
+        return false;
+    }
     return true;
 }
 
+#ifndef DRIVER
+/*
+ * process_init: Reserves memsys's address space and builds the heap in it,
+ *               then registers the fork handlers that keep the locks
+ *               usable in a child. Run once, by heap_init.
+ */
+static void process_init(void)
+{
+    mem_init(false);
+    if (mm_init())
+    {
+#if MM_THREADS
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+#endif
+    }
+}
+
+#if MM_THREADS
+/*
+ * fork_prepare: Takes every allocator lock before a fork, in the order the
+ *               allocator itself takes them, so no other thread is in the
+ *               middle of changing the heap when it is copied.
+ */
+static void fork_prepare(void)
+{
+    int i;
+    for(i=0; i<MM_ARENAS; ++i)
+    {
+        pthread_mutex_lock(&arenas[i].mutex);
+    }
+    pthread_mutex_lock(&sbrk_mutex);
+}
+
+/*
+ * fork_parent: Releases the locks taken by fork_prepare in the parent.
+ */
+static void fork_parent(void)
+{
+    int i;
+    pthread_mutex_unlock(&sbrk_mutex);
+    for(i=MM_ARENAS-1; i>=0; --i)
+    {
+        pthread_mutex_unlock(&arenas[i].mutex);
+    }
+}
+
+/*
+ * fork_child: Resets the locks in the child, whose only thread is the one
+ *             that forked. Blocks in other threads' caches stay allocated.
+ */
+static void fork_child(void)
+{
+    int i;
+    pthread_mutex_init(&sbrk_mutex, NULL);
+    for(i=0; i<MM_ARENAS; ++i)
+    {
+        pthread_mutex_init(&arenas[i].mutex, NULL);
+    }
+}
+#endif
+#endif
+
 /*
  * malloc: Allocates new block of at least size bytes. Returns a pointer to the
  *         payload of the newly allocated block.
@@ -229,39 +1011,74 @@ void *malloc(size_t size)
     dbg_requires(mm_checkheap(__LINE__));
 
     size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;
     void *bp = NULL;
 
-    if (heap_start == NULL) // Initialize heap if it isn't initialized
+    if (!heap_init()) // Initialize heap if it isn't initialized
     {
-        mm_init();
+        return bp;
     }
 
     if (size == 0) // Ignore spurious request
     {
+#ifdef DRIVER
         dbg_ensures(mm_checkheap(__LINE__));
         return bp;
+#else
+        // programs take NULL for running out of memory
+        size = 1;
+#endif
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
+    if (size > (size_t)-1 / 4)
+    {
+        // no heap or mapping could hold it, and the block size would wrap
+        errno = ENOMEM;
+        return bp;
+    }
+    count_call(stat_mallocs, 1);
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+#if MM_MMAP_THRESHOLD > 0
+    if (size >= MM_MMAP_THRESHOLD)
+    {
+        return map_block(size, dsize);
+    }
+#endif
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL)
+#if MM_SLAB
+    if (size <= slab_max_size)
     {
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        if (block == NULL) // extend_heap returns an error
+        arena_t *arena = thread_arena_get();
+        lock_arena(arena);
+        bp = slab_malloc(arena, size);
+        unlock_arena(arena);
+        // falls back to an ordinary block if no run could be made
+        if (bp != NULL)
         {
+            dbg_ensures(mm_checkheap(__LINE__));
             return bp;
         }
     }
+#endif
 
-    place(block, asize);
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + wsize, dsize);
+
+#if MM_TCACHE
+    if (asize <= tcache_max_size)
+    {
+        return tcache_malloc(asize);
+    }
+#endif
+
+    arena_t *arena = thread_arena_get();
+    lock_arena(arena);
+    block = alloc_block(arena, asize, NULL);
+    unlock_arena(arena);
+    if (block == NULL) // extend_heap returns an error
+    {
+        return bp;
+    }
     bp = header_to_payload(block);
 
     dbg_ensures(mm_checkheap(__LINE__));
@@ -278,22 +1095,82 @@ void free(void *bp)
     {
         return;
     }
+    count_call(stat_frees, 1);
 
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
 
-    // updating header and writing footer for this block
-    write_header(block, size, false);
-    write_footer(block, size, false);
+#if MM_MMAP_THRESHOLD > 0
+    if (is_mapped(bp))
+    {
+        unmap_block(block);
+        return;
+    }
+#endif
 
-    // updating header for next block
-    block_t *next_block = find_next(block);
-    update_prev_alloc(next_block, false);
+#if MM_SLAB
+    slab_run_t *run = slab_find_run(bp);
+    if (run != NULL)
+    {
+        arena_t *arena = get_arena(payload_to_header(run));
+        lock_arena(arena);
+        slab_free(run, bp);
+        unlock_arena(arena);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
 
-    // coalescing incase neighboring blocks are also free
-    coalesce(block);
+    release_block(block);
+}
 
-    dbg_ensures(mm_checkheap(__LINE__));
+/*
+ * mm_free_sized: Frees the block at bp, which was last allocated or resized
+ *                with size bytes. Blocks that the size places in a thread
+ *                cache bin are parked without reading their header, and
+ *                sizes too large for a slab skip the slab lookup.
+ */
+void mm_free_sized(void *bp, size_t size)
+{
+    if (bp == NULL)
+    {
+        return;
+    }
+    dbg_requires(check_free_size(bp, size, __LINE__));
+    count_call(stat_frees, 1);
+
+#if MM_MMAP_THRESHOLD > 0
+    if (is_mapped(bp))
+    {
+        unmap_block(payload_to_header(bp));
+        return;
+    }
+#endif
+
+#if MM_SLAB
+    slab_run_t *run = size <= slab_max_size ? slab_find_run(bp) : NULL;
+    if (run != NULL)
+    {
+        arena_t *arena = get_arena(payload_to_header(run));
+        lock_arena(arena);
+        slab_free(run, bp);
+        unlock_arena(arena);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+#endif
+
+#if MM_TCACHE
+    // the block may be up to a small block larger than asize, like the
+    // ones tcache_malloc cuts when it refills a bin
+    size_t asize = round_up(size + wsize, dsize);
+    if (asize <= tcache_max_size)
+    {
+        tcache_free(payload_to_header(bp), asize);
+        return;
+    }
+#endif
+
+    release_block(payload_to_header(bp));
 }
 
 /*
@@ -306,6 +1183,8 @@ void *realloc(void *ptr, size_t size)
     size_t copysize;
     void *newptr;
 
+    count_call(stat_reallocs, 1);
+
     // If size == 0, then free block and return NULL
     if (size == 0)
     {
@@ -319,6 +1198,20 @@ void *realloc(void *ptr, size_t size)
         return malloc(size);
     }
 
+    if (size > (size_t)-1 / 4)
+    {
+        // as in malloc; the original block is left untouched
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Try to resize the block where it is
+    if (resize_in_place(ptr, size))
+    {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return ptr;
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
     // If malloc fails, the original block is left untouched
@@ -329,6 +1222,13 @@ void *realloc(void *ptr, size_t size)
 
     // Copy the old data
     copysize = get_payload_size(block); // gets size of old payload
+#if MM_SLAB
+    slab_run_t *run = slab_find_run(ptr);
+    if (run != NULL)
+    {
+        copysize = run->slot_size;
+    }
+#endif
     if(size < copysize)
     {
         copysize = size;
@@ -349,410 +1249,3519 @@ void *calloc(size_t elements, size_t size)
 {
     void *bp;
     size_t asize = elements * size;
+    size_t bsize = round_up(asize + wsize, dsize);
+    size_t dirty;
+    bool recycled = false; // served from memory that was handed out before
 
-    if (asize/elements != size)
+    if ((elements != 0 && asize/elements != size) || asize > (size_t)-1 / 4)
     {
-        // Multiplication overflowed
+        // Multiplication overflowed, or no heap could hold the result
+        errno = ENOMEM;
         return NULL;
     }
 
-    bp = malloc(asize);
-    if (bp == NULL)
+    if (!heap_init()) // Initialize heap if it isn't initialized
+    {
+        return NULL;
+    }
+
+    if (asize == 0)
+    {
+        return malloc(0);
+    }
+
+#if MM_MMAP_THRESHOLD > 0
+    if (asize >= MM_MMAP_THRESHOLD)
+    {
+        // a fresh mapping reads as zero
+        count_call(stat_mallocs, 1);
+        return map_block(asize, dsize);
+    }
+#endif
+#if MM_SLAB
+    recycled |= asize <= slab_max_size;
+#endif
+#if MM_TCACHE
+    recycled |= bsize <= tcache_max_size;
+#endif
+
+    if (recycled)
+    {
+        bp = malloc(asize);
+        if (bp == NULL)
+        {
+            return NULL;
+        }
+        // Initialize all bits to 0
+        memset(bp, 0, asize);
+        return bp;
+    }
+
+    count_call(stat_mallocs, 1);
+    arena_t *arena = thread_arena_get();
+    lock_arena(arena);
+    block_t *block = alloc_block(arena, bsize, &dirty);
+    unlock_arena(arena);
+    if (block == NULL)
     {
         return NULL;
     }
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    bp = header_to_payload(block);
+
+    // Only the part below the zero frontier can hold old data
+    if (dirty >= asize)
+    {
+        memset(bp, 0, asize);
+    }
+    else
+    {
+        memset(bp, 0, dirty);
+        // the last word may be the footer of the free block it came from
+        word_t *last = (word_t *)((char *)block + get_size(block)) - 1;
+        if ((char *)last < (char *)bp + asize)
+        {
+            write_word(last, 0);
+        }
+    }
 
+    dbg_ensures(mm_checkheap(__LINE__));
     return bp;
 }
 
-/******** The remaining content below are helper and debug routines ********/
-
 /*
- * extend_heap: Extends heap by size bytes. Uses sbrk
+ * memalign: allocates a block of at least size bytes whose payload is
+ *           aligned to alignment bytes, which must be a power of two. The
+ *           block is cut from a free block with room for the alignment,
+ *           and the slack in front of it is freed.
  */
-static block_t *extend_heap(size_t size)
+void *memalign(size_t alignment, size_t size)
 {
-    void *bp;
+    size_t asize;
+    block_t *block;
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
     {
+        errno = EINVAL;
         return NULL;
     }
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_header(block, size, false);
-    write_footer(block, size, false);
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_header(block_next, 0, true);
-    update_prev_alloc(block_next, false);
-    update_prev_sblock(block_next, false);
+    // every payload is aligned to dsize already
+    if (alignment <= dsize)
+    {
+        return malloc(size);
+    }
 
-    // Coalesce in case the neighboring blocks are free
-    return coalesce(block);
+    if (!heap_init()) // Initialize heap if it isn't initialized
+    {
+        return NULL;
+    }
+
+    if (size == 0)
+    {
+#ifdef DRIVER
+        return NULL;
+#else
+        // as in malloc, an empty request still gets a block
+        size = 1;
+#endif
+    }
+
+    if (size > (size_t)-1 / 4 || alignment > (size_t)-1 / 4)
+    {
+        // no heap or mapping could hold it, and the sums below could wrap
+        errno = ENOMEM;
+        return NULL;
+    }
+    count_call(stat_mallocs, 1);
+
+#if MM_MMAP_THRESHOLD > 0
+    if (size >= MM_MMAP_THRESHOLD)
+    {
+        return map_block(size, alignment);
+    }
+#endif
+
+    asize = round_up(size + wsize, dsize);
+    arena_t *arena = thread_arena_get();
+    lock_arena(arena);
+    block = alloc_aligned_block(arena, alignment, asize);
+    unlock_arena(arena);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return header_to_payload(block);
 }
 
 /*
- * coalesce: Coalesces (and frees) a block with any already free adjacent
- *           blocks. Returns a pointer to the beginning of that block.
+ * posix_memalign: stores in memptr a block of at least size bytes aligned to
+ *                 alignment bytes, a power of two multiple of sizeof(void *).
+ *                 Returns 0, or EINVAL or ENOMEM leaving memptr untouched.
  */
-static block_t *coalesce(block_t * block)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    bool coalesced = false;
-    block_t* new_block = block;
-    size_t size = get_size(block);
+    void *bp;
 
-    // checking previous
-    if(!get_prev_alloc(block))
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
     {
-        word_t* prev_footer = find_prev_footer(block);
-        if(!extract_alloc(*prev_footer)) {
-            size += extract_size(*prev_footer);
-            new_block = find_prev(block);
-            remove_block(new_block);
-            coalesced=true;
-        }
+        return EINVAL;
     }
 
-    block_t* next_block = find_next(block);
-    // checking next
-    if(!get_alloc(next_block))
+    if (size == 0)
     {
-        size += get_size(next_block);
-        remove_block(next_block);
-        coalesced=true;
+        *memptr = NULL;
+        return 0;
     }
 
-    write_header(new_block, size, false);
-    write_footer(new_block, size, false);
+    bp = memalign(alignment, size);
+    if (bp == NULL)
+    {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
 
-    // adding free block
-    add_free_block(new_block);
+/*
+ * aligned_alloc: the C11 name for memalign
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
 
-    if(coalesced)
+/*
+ * valloc: allocates a block of at least size bytes aligned to a page
+ */
+void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+/*
+ * pvalloc: allocates a page aligned block of size bytes rounded up to a
+ *          whole number of pages
+ */
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > (size_t)-1 / 4)
     {
-        // updating prev_sblock
-        next_block=find_next(new_block);
-        // if were coalescing, the resulting block is never small
-        update_prev_sblock(next_block, false);
+        errno = ENOMEM;
+        return NULL;
     }
-
-    return new_block;
+    return memalign(page, round_up(max(size, 1), page));
 }
 
 /*
- * place: Places block in heap. Updates headers and footers for blocks
+ * reallocarray: resizes ptr to hold nmemb elements of size bytes, failing
+ *               with ENOMEM instead of wrapping if the product overflows
  */
-static void place(block_t *block, size_t asize)
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
 {
-    size_t csize = get_size(block);
-    block_t *block_next; // pointer to next block in memory
+    size_t bytes = nmemb * size;
 
-    // if we can split the block
-    if ((csize - asize) >= min_block_size)
+    if (nmemb != 0 && bytes / nmemb != size)
     {
-        remove_block(block);
-        write_header(block, asize, true);
-        // clearing old footer
-        *(word_t*)((char*)block+get_size(block)) = 0;
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
 
-        // the new block split must be free
-        block_next = find_next(block);
-        write_header(block_next, csize-asize, false);
-        write_footer(block_next, csize-asize, false);
-        update_prev_alloc(block_next, true);
-        update_prev_sblock(block_next, asize==min_block_size ? true:false);
+/*
+ * malloc_usable_size: returns how many bytes the block at bp can hold, at
+ *                     least as many as it was last allocated or resized
+ *                     with. 0 for NULL.
+ */
+size_t malloc_usable_size(void *bp)
+{
+    if (bp == NULL)
+    {
+        return 0;
+    }
+#if MM_SLAB
+    slab_run_t *run = slab_find_run(bp);
+    if (run != NULL)
+    {
+        return run->slot_size;
+    }
+#endif
+    return get_payload_size(payload_to_header(bp));
+}
 
-        //------updating pointers given new block-------
-        // Adding newly freed block to list
-        add_free_block(block_next);
+/*
+ * mm_malloc_batch: allocates n blocks of size bytes each and stores their
+ *                  payload pointers in out. Returns how many were allocated,
+ *                  which is less than n only if the heap ran out. The blocks
+ *                  are cut back to back from as few free blocks as possible,
+ *                  each taken off the free lists once.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t asize;
+    size_t count = 0;
+    bool single = false; // requests that never touch the free lists
 
-        // updating prev_sblock bit in the next next block if the split block
-        // is small
-        block_next = find_next(block_next);
-        update_prev_sblock(block_next, csize-asize==min_block_size ? true:false);
+    if (!heap_init()) // Initialize heap if it isn't initialized
+    {
+        return 0;
     }
-    else
+
+    if (size == 0 || n == 0)
     {
-        // removing block from list
-        remove_block(block);
+        return 0;
+    }
 
-        // writing new header
-        write_header(block, csize, true);
+    asize = round_up(size + wsize, dsize);
+    if (n > ((size_t)-1 - chunksize) / asize)
+    {
+        // the total size would overflow
+        return 0;
+    }
 
-        block_next = find_next(block);
-        update_prev_alloc(block_next, true);
-        update_prev_sblock(block_next, csize==min_block_size ? true:false);
+#if MM_MMAP_THRESHOLD > 0
+    single |= size >= MM_MMAP_THRESHOLD;
+#endif
+#if MM_SLAB
+    single |= size <= slab_max_size;
+#endif
+#if MM_TCACHE
+    single |= asize <= tcache_max_size;
+#endif
+
+    if (single || n == 1)
+    {
+        while (count < n && (out[count] = malloc(size)) != NULL)
+        {
+            count++;
+        }
+        return count;
+    }
+
+    count_call(stat_mallocs, n);
+    arena_t *arena = thread_arena_get();
+    lock_arena(arena);
+    while (count < n)
+    {
+        block_t *block;
+#if MM_FASTBINS
+        if (asize <= fastbin_max_size &&
+            (block = fastbin_pop(arena, asize)) != NULL)
+        {
+            out[count++] = header_to_payload(block);
+            continue;
+        }
+#endif
+        // prefer one block with room for the rest, then any that fits one
+        size_t want = asize * (n - count);
+        block = find_fit(arena, want);
+        if (block == NULL && want != asize)
+        {
+            block = find_fit(arena, asize);
+        }
+#if MM_FASTBINS
+        if (block == NULL && fastbin_consolidate(arena))
+        {
+            continue;
+        }
+#endif
+        if (block == NULL)
+        {
+            block = extend_to_fit(arena, want);
+        }
+        if (block == NULL) // extend_heap returns an error
+        {
+            break;
+        }
+        count += carve_blocks(block, asize, n - count, out + count);
+    }
+    unlock_arena(arena);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return count;
+}
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs, which may hold NULLs. ptrs is
+ *                sorted by address, so blocks that lie next to each other
+ *                are joined and coalesced with their neighbours just once.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j;
+
+    if (n == 1)
+    {
+        free(ptrs[0]);
+        return;
+    }
+    if (n <= batch_sort_min)
+    {
+        // insertion sort beats qsort on the short runs most callers have
+        for (i = 1; i < n; i++)
+        {
+            void *bp = ptrs[i];
+            for (j = i; j > 0 && (char *)ptrs[j - 1] > (char *)bp; j--)
+            {
+                ptrs[j] = ptrs[j - 1];
+            }
+            ptrs[j] = bp;
+        }
+    }
+    else
+    {
+        qsort(ptrs, n, sizeof(void *), compare_addr);
+    }
+
+    for (i = 0; i < n; i = j)
+    {
+        j = i + 1;
+        if (ptrs[i] == NULL)
+        {
+            continue;
+        }
+        if (!frees_to_lists(ptrs[i]))
+        {
+            free(ptrs[i]);
+            continue;
+        }
+
+        // gather the run of blocks that follow this one in memory
+        block_t *block = payload_to_header(ptrs[i]);
+        block_t *next = find_next(block);
+        arena_t *arena = get_arena(block);
+        while (j < n && ptrs[j] == header_to_payload(next) &&
+               frees_to_lists(ptrs[j]) && get_arena(next) == arena)
+        {
+            next = find_next(next);
+            j++;
+        }
+
+        count_call(stat_frees, j - i);
+        lock_arena(arena);
+        size_t size = (char *)next - (char *)block;
+        write_header(block, size, true);
+        update_prev_sblock(next, size == min_block_size);
+        forget_blocks(block, next);
+        free_block(block);
+        unlock_arena(arena);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * mm_region_create: returns an empty region, or NULL if the heap ran out or
+ *                   the build is SPARSE_MODE. A region takes no chunk until
+ *                   its first allocation.
+ */
+mm_region_t *mm_region_create(void)
+{
+#if SPARSE_MODE
+    return NULL;
+#endif
+    mm_region_t *region = malloc(sizeof(mm_region_t));
+    if (region == NULL)
+    {
+        return NULL;
+    }
+    region->chunks = NULL;
+    region->current = NULL;
+    region->next = NULL;
+    region->end = NULL;
+    region->chunk_size = region_chunk_min;
+    return region;
+}
+
+/*
+ * mm_region_alloc: allocates size bytes from region, aligned to 16 bytes.
+ *                  Returns NULL if size is 0 or the heap ran out. The block
+ *                  lives until the region is reset or destroyed.
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size)
+{
+    if (size == 0 || size > (size_t)-1 / 4)
+    {
+        return NULL;
+    }
+    size_t asize = round_up(size, dsize);
+    if (asize > (size_t)(region->end - region->next))
+    {
+        return region_grow(region, asize);
+    }
+    void *bp = region->next;
+    region->next += asize;
+    return bp;
+}
+
+/*
+ * mm_region_reset: frees every block allocated from region at once. All
+ *                  chunks but the current one go back to the heap, and the
+ *                  current one is reused from its start.
+ */
+void mm_region_reset(mm_region_t *region)
+{
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk_t *prev = chunk->prev;
+        if (chunk != region->current)
+        {
+            free(chunk);
+        }
+        chunk = prev;
+    }
+    region->chunks = region->current;
+    if (region->current != NULL)
+    {
+        region->current->prev = NULL;
+        region->next = (char *)(region->current + 1);
+        region->end = (char *)region->current + region->current->size;
+    }
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * mm_region_destroy: frees every block allocated from region and the region
+ *                    itself.
+ */
+void mm_region_destroy(mm_region_t *region)
+{
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    free(region);
+}
+
+/******** The remaining content below are helper and debug routines ********/
+
+/*
+ * alloc_block: Finds or makes room in arena for a block of asize bytes and
+ *              places it. Returns the allocated block, or NULL if the heap is
+ *              exhausted. If dirty is not NULL, it is set to the number of
+ *              leading payload bytes that may not read as zero. Caller must
+ *              hold the arena lock.
+ */
+static block_t *alloc_block(arena_t *arena, size_t asize, size_t *dirty)
+{
+    block_t *block;
+
+#if MM_REMOTE_FREE
+    remote_drain(arena);
+#endif
+#if MM_PURGE_DECAY > 0
+    purge_tick(arena);
+#endif
+
+#if MM_FASTBINS
+    if (asize <= fastbin_max_size &&
+        (block = fastbin_pop(arena, asize)) != NULL)
+    {
+        if (dirty != NULL)
+        {
+            *dirty = asize; // it was in use a moment ago
+        }
+        return block;
+    }
+#endif
+
+    block = fit_or_extend(arena, asize);
+    if (block == NULL) // extend_heap returns an error
+    {
+        return NULL;
+    }
+
+    if (dirty != NULL)
+    {
+        *dirty = dirty_bytes(block);
+    }
+    place(block, asize);
+    return block;
+}
+
+/*
+ * release_block: Hands an allocated heap block, not a slab slot or mapped
+ *                block, to the thread cache, the fast bins or the free lists.
+ */
+static void release_block(block_t *block)
+{
+#if MM_TCACHE
+    size_t size = get_size(block);
+    if (size <= tcache_max_size)
+    {
+        tcache_free(block, size);
+        return;
+    }
+#endif
+
+    arena_t *arena = get_arena(block);
+#if MM_REMOTE_FREE
+    if (is_remote(arena))
+    {
+        remote_push(arena, block);
+        return;
+    }
+#endif
+    lock_arena(arena);
+#if MM_REMOTE_FREE
+    remote_drain(arena);
+#endif
+    release_locked(block);
+    unlock_arena(arena);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/*
+ * release_locked: Hands an allocated heap block to the fast bins or the free
+ *                 lists. Caller must hold the lock of the block's arena.
+ */
+static void release_locked(block_t *block)
+{
+#if MM_FASTBINS
+    if (get_size(block) <= fastbin_max_size)
+    {
+        fastbin_push(get_arena(block), block);
+        return;
+    }
+#endif
+    free_block(block);
+}
+
+#if MM_REMOTE_FREE
+/*
+ * remote_push: Queues an allocated block for its arena to free, without
+ *              taking the arena lock. The block is linked through its
+ *              first payload word; any number of threads may push at once.
+ */
+static void remote_push(arena_t *arena, block_t *block)
+{
+    block_t *head = __atomic_load_n(&arena->remote_head, __ATOMIC_RELAXED);
+    do
+    {
+        block->payload.parked_next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_head, &head, block,
+                                          true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain: Frees every block other threads have queued on the arena.
+ *               The queue is taken whole with one exchange, so pushes that
+ *               race with it land in the next drain. Caller must hold the
+ *               arena lock.
+ */
+static void remote_drain(arena_t *arena)
+{
+    if (__atomic_load_n(&arena->remote_head, __ATOMIC_RELAXED) == NULL)
+    {
+        return;
+    }
+    block_t *block = __atomic_exchange_n(&arena->remote_head, NULL,
+                                         __ATOMIC_ACQUIRE);
+    unsigned long n = 0;
+    while (block != NULL)
+    {
+        block_t *next = block->payload.parked_next;
+        release_locked(block);
+        block = next;
+        ++n;
+    }
+    count_stat(arena, stat_remote_frees, n);
+}
+
+/*
+ * is_remote: Returns true if a block of arena freed by the calling thread
+ *            goes on the arena's queue: the arena is not the caller's, and
+ *            some thread still allocates from it to drain the queue.
+ */
+static bool is_remote(arena_t *arena)
+{
+    return arena != thread_arena_get() &&
+           __atomic_load_n(&arena->users, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * arena_key_create: Creates the key whose destructor is arena_exit
+ */
+static void arena_key_create(void)
+{
+    pthread_key_create(&arena_key, arena_exit);
+}
+
+/*
+ * arena_exit: Takes an exiting thread out of its arena, and empties the
+ *             arena's queue if no thread is left there to do it.
+ */
+static void arena_exit(void *arg)
+{
+    arena_t *left = thread_arena_set(NULL);
+    if (left != NULL)
+    {
+        lock_arena(left);
+        remote_drain(left);
+        unlock_arena(left);
+    }
+}
+#endif
+
+/*
+ * fit_or_extend: Returns a free block of at least asize bytes from the free
+ *                lists, growing the heap if none fits, or NULL if the heap is
+ *                exhausted. The block is left in the free lists. Caller must
+ *                hold the arena lock.
+ */
+static block_t *fit_or_extend(arena_t *arena, size_t asize)
+{
+    // Search the free list for a fit
+    block_t *block = find_fit(arena, asize);
+#if MM_FASTBINS
+    if (block == NULL && fastbin_consolidate(arena))
+    {
+        block = find_fit(arena, asize);
+    }
+#endif
+
+    // If no fit is found, request more memory
+    if (block == NULL)
+    {
+        block = extend_to_fit(arena, asize);
+    }
+    return block;
+}
+
+/*
+ * extend_to_fit: Grows the heap so that the free block at its top holds at
+ *                least asize bytes, and returns that block, or NULL if the
+ *                heap is exhausted. Caller must hold the arena lock.
+ */
+static block_t *extend_to_fit(arena_t *arena, size_t asize)
+{
+    size_t extendsize = max(asize, chunksize); // Amount to extend heap by
+    block_t *block;
+
+    // a free block at the top of the heap only needs topping up
+    block_t *top = top_block(arena);
+    if (top != NULL && !get_alloc(top))
+    {
+        if (get_size(top) >= asize)
+        {
+            return top;
+        }
+        extendsize = max(asize - get_size(top), chunksize);
+    }
+
+    block = extend_heap(arena, extendsize);
+    // another arena may have moved the break since we looked
+    if (block != NULL && get_size(block) < asize)
+    {
+        block = extend_heap(arena, max(asize, chunksize));
+    }
+    return block;
+}
+
+/*
+ * alloc_aligned_block: Like alloc_block, but the payload of the returned
+ *                      block is aligned to align bytes, a power of two. The
+ *                      space before and after the aligned block is freed.
+ */
+static block_t *alloc_aligned_block(arena_t *arena, size_t align, size_t asize)
+{
+    // a block of asize may already be aligned, e.g. the hole of a freed run
+    block_t *block = find_fit(arena, asize);
+    if (block == NULL || !aligned_fit(block, align, asize))
+    {
+        block = find_fit(arena, asize + align);
+    }
+#if MM_FASTBINS
+    if (block == NULL && fastbin_consolidate(arena))
+    {
+        block = find_fit(arena, asize + align);
+    }
+#endif
+
+    if (block == NULL)
+    {
+        block = extend_aligned(arena, align, asize);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+    place(block, get_size(block));
+
+    size_t bp = (size_t)header_to_payload(block);
+    size_t gap = round_up(bp, align) - bp;
+    if (gap != 0)
+    {
+        // split off the leading gap, which is at least one small block
+        size_t csize = get_size(block);
+        block_t *aligned = (block_t *)((char *)block + gap);
+        write_word(&aligned->header, 0);
+        write_arena(aligned, arena);
+        write_header(aligned, csize - gap, true);
+        update_prev_alloc(aligned, true);
+        update_prev_sblock(aligned, gap == min_block_size);
+        update_prev_sblock(find_next(aligned), csize - gap == min_block_size);
+        write_header(block, gap, true);
+        free_block(block);
+        block = aligned;
+    }
+
+    shrink_block(block, asize);
+    return block;
+}
+
+/*
+ * extend_aligned: Returns a free block at the top of the arena with room for
+ *                 an aligned block of asize bytes, growing the heap only by
+ *                 what the free space already at the top lacks.
+ */
+static block_t *extend_aligned(arena_t *arena, size_t align, size_t asize)
+{
+    block_t *top = top_block(arena);
+    size_t extendsize = asize + align;
+
+    if (top != NULL)
+    {
+        // the epilogue's payload is where a new block's payload would go
+        size_t tail = get_alloc(top) ? 0 : get_size(top);
+        size_t bp = (size_t)header_to_payload(top);
+        size_t fit = round_up(bp, align) - bp + asize;
+        if (fit <= tail)
+        {
+            return top;
+        }
+        extendsize = fit - tail;
+    }
+
+    block_t *block = extend_heap(arena, extendsize);
+    // another arena may have moved the break since we looked
+    if (block != NULL && !aligned_fit(block, align, asize))
+    {
+        block = extend_heap(arena, asize + align);
+    }
+    return block;
+}
+
+/*
+ * top_block: Returns the last block of the arena if its chunk ends at the
+ *            break, so that extending the heap grows it: the free block
+ *            before the epilogue, or the epilogue itself if the last block
+ *            is allocated. Returns NULL if the arena cannot grow in place.
+ */
+static block_t *top_block(arena_t *arena)
+{
+    block_t *top = arena->epilogue;
+    bool at_break;
+
+    lock_sbrk();
+    at_break = top != NULL && (char *)top + wsize == (char *)mem_heap_hi() + 1;
+    unlock_sbrk();
+
+    if (!at_break)
+    {
+        return NULL;
+    }
+    return get_prev_alloc(top) ? top : find_prev(top);
+}
+
+/*
+ * aligned_fit: returns true if block has room for an aligned block of asize
+ */
+static bool aligned_fit(block_t *block, size_t align, size_t asize)
+{
+    size_t bp = (size_t)header_to_payload(block);
+    return round_up(bp, align) - bp + asize <= get_size(block);
+}
+
+/*
+ * shrink_block: Cuts an allocated block down to asize bytes, returning the
+ *               rest to the free lists if it is large enough to be a block.
+ *               Caller must hold the lock of the block's arena.
+ */
+static void shrink_block(block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    if (csize - asize < min_block_size)
+    {
+        return;
+    }
+
+    write_header(block, asize, true);
+    block_t *rest = find_next(block);
+    write_word(&rest->header, 0);
+    write_arena(rest, get_arena(block));
+    write_header(rest, csize - asize, true);
+    update_prev_alloc(rest, true);
+    update_prev_sblock(rest, asize == min_block_size);
+    update_prev_sblock(find_next(rest), csize - asize == min_block_size);
+    free_block(rest);
+}
+
+/*
+ * carve_blocks: Takes the free block off the free lists and cuts up to n
+ *               allocated blocks of asize bytes from its front, storing
+ *               their payloads in out. What is left goes back to the free
+ *               lists, or to the last block if it is too small to be a
+ *               block. Returns the number of blocks cut. Caller must hold
+ *               the lock of the block's arena.
+ */
+static size_t carve_blocks(block_t *block, size_t asize, size_t n, void **out)
+{
+    size_t csize = get_size(block);
+    size_t count = csize / asize < n ? csize / asize : n;
+    size_t rest = csize - count * asize;
+    arena_t *arena = get_arena(block);
+    block_t *last = block;
+    size_t i;
+
+    remove_block(block);
+    for (i = 0; i < count; i++)
+    {
+        size_t size = asize;
+        if (i == count - 1 && rest < min_block_size)
+        {
+            size += rest;
+            rest = 0;
+        }
+        if (i > 0)
+        {
+            last = find_next(last);
+            write_word(&last->header, 0);
+            write_arena(last, arena);
+            write_header(last, size, true);
+            update_prev_alloc(last, true);
+            update_prev_sblock(last, asize == min_block_size);
+        }
+        else
+        {
+            write_header(last, size, true);
+        }
+        out[i] = header_to_payload(last);
+    }
+
+    block_t *next = find_next(last);
+    if (rest != 0)
+    {
+        write_word(&next->header, 0);
+        write_arena(next, arena);
+        write_header(next, rest, false);
+        write_footer(next, rest, false);
+        update_prev_alloc(next, true);
+        update_prev_sblock(next, get_size(last) == min_block_size);
+        add_free_block(next);
+        update_prev_sblock(find_next(next), rest == min_block_size);
+    }
+    else
+    {
+        update_prev_alloc(next, true);
+        update_prev_sblock(next, get_size(last) == min_block_size);
+    }
+
+    count_stat(arena, stat_splits, rest != 0 ? count : count - 1);
+    count_stat(arena, stat_exact_fits, rest != 0 ? 0 : 1);
+    raise_zero_frontier(last);
+    return count;
+}
+
+/*
+ * frees_to_lists: returns true if free() would hand the block at bp straight
+ *                 back to the arena's free lists
+ */
+static bool frees_to_lists(void *bp)
+{
+#if MM_MMAP_THRESHOLD > 0
+    if (is_mapped(bp))
+    {
+        return false;
+    }
+#endif
+#if MM_SLAB
+    if (slab_find_run(bp) != NULL)
+    {
+        return false;
+    }
+#endif
+    size_t size = get_size(payload_to_header(bp));
+    (void)size;
+#if MM_TCACHE
+    if (size <= tcache_max_size)
+    {
+        return false;
+    }
+#endif
+#if MM_FASTBINS
+    if (size <= fastbin_max_size)
+    {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/*
+ * compare_addr: orders pointers by address for qsort
+ */
+static int compare_addr(const void *a, const void *b)
+{
+    char *x = *(char *const *)a;
+    char *y = *(char *const *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * region_grow: Takes a chunk from the heap for an allocation of asize bytes
+ *              that the current chunk of region has no room for, and
+ *              returns the allocation. Large requests get a chunk of
+ *              exactly their size behind the current one; otherwise the
+ *              new chunk becomes current, abandoning the tail of the old.
+ */
+static void *region_grow(mm_region_t *region, size_t asize)
+{
+    size_t size = region->chunk_size;
+    bool own = asize > size / 4;
+    if (own)
+    {
+        size = sizeof(region_chunk_t) + asize;
+    }
+
+    region_chunk_t *chunk = malloc(size);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->prev = region->chunks;
+    region->chunks = chunk;
+    if (own)
+    {
+        return chunk + 1;
+    }
+
+    region->current = chunk;
+    region->next = (char *)(chunk + 1) + asize;
+    region->end = (char *)chunk + size;
+    if (region->chunk_size < region_chunk_max)
+    {
+        region->chunk_size *= 2;
+    }
+    return chunk + 1;
+}
+
+/*
+ * resize_in_place: Tries to make the block at bp hold size bytes without
+ *                  moving it. Returns true on success, in which case the
+ *                  block keeps its address and contents.
+ */
+static bool resize_in_place(void *bp, size_t size)
+{
+    block_t *block = payload_to_header(bp);
+    bool resized;
+
+#if MM_MMAP_THRESHOLD > 0
+    if (is_mapped(bp))
+    {
+        // a block that drops below the threshold moves into the heap
+        return size <= get_payload_size(block) && size >= MM_MMAP_THRESHOLD;
+    }
+#endif
+#if MM_SLAB
+    slab_run_t *run = slab_find_run(bp);
+    if (run != NULL)
+    {
+        return size <= run->slot_size;
+    }
+#endif
+
+    size_t asize = round_up(size + wsize, dsize);
+    arena_t *arena = get_arena(block);
+    lock_arena(arena);
+    if (asize <= get_size(block))
+    {
+        shrink_block(block, asize);
+        resized = true;
+    }
+    else
+    {
+        resized = grow_block(arena, block, asize);
+    }
+    unlock_arena(arena);
+    return resized;
+}
+
+/*
+ * grow_block: Grows an allocated block to asize bytes by absorbing the free
+ *             block after it. If the block is the last one below the break,
+ *             the heap is first extended by what the two together lack.
+ *             Returns false if the block cannot grow. Caller must hold the
+ *             arena lock.
+ */
+static bool grow_block(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *next = find_next(block);
+    size_t avail = csize + (get_alloc(next) ? 0 : get_size(next));
+
+    if (avail < asize)
+    {
+        // only the block at the top of the heap can grow past its neighbour
+        if (top_block(arena) != next ||
+            extend_heap(arena, asize - avail) == NULL)
+        {
+            return false;
+        }
+        // the extension coalesced into a free block right after ours, unless
+        // another arena moved the break since we looked
+        next = find_next(block);
+        avail = csize + (get_alloc(next) ? 0 : get_size(next));
+        if (avail < asize)
+        {
+            return false;
+        }
+    }
+
+    remove_block(next);
+    write_header(block, avail, true);
+    raise_zero_frontier(block);
+    next = find_next(block);
+    forget_blocks(block, next);
+    update_prev_alloc(next, true);
+    update_prev_sblock(next, false);
+    shrink_block(block, asize);
+    return true;
+}
+
+/*
+ * free_block: Returns an allocated block to the free lists, coalescing it
+ *             with its neighbours. Caller must hold the lock of the block's
+ *             arena.
+ */
+static void free_block(block_t *block)
+{
+    size_t size = get_size(block);
+
+    // updating header and writing footer for this block
+    write_header(block, size, false);
+    write_footer(block, size, false);
+
+    // updating header for next block
+    block_t *next_block = find_next(block);
+    update_prev_alloc(next_block, false);
+
+    // coalescing incase neighboring blocks are also free
+    block = coalesce(block);
+#if MM_TRIM_THRESHOLD > 0
+    trim_heap(block);
+#endif
+#if MM_PURGE_DECAY > 0
+    purge_tick(get_arena(block));
+#endif
+}
+
+#if MM_TRIM_THRESHOLD > 0
+/*
+ * trim_heap: Lowers the break if block is a free block of more than
+ *            MM_TRIM_THRESHOLD plus the arena's trim_extra bytes at the top
+ *            of the heap. It keeps trim_pad plus trim_extra bytes of it, so
+ *            the next requests need not extend the heap straight away.
+ *            Caller must hold the lock of the block's arena.
+ */
+static void trim_heap(block_t *block)
+{
+    size_t size = get_size(block);
+    arena_t *arena = get_arena(block);
+
+    if (size <= MM_TRIM_THRESHOLD + arena->trim_extra ||
+        find_next(block) != arena->epilogue)
+    {
+        return;
+    }
+
+    lock_sbrk();
+    // keep the break a multiple of memlib's granule
+    size_t keep = trim_pad + arena->trim_extra;
+    size_t granule = mem_granule();
+    if (granule > dsize)
+    {
+        size_t base = mem_heapsize() - size;
+        keep = round_up(base + keep, granule) - base;
+    }
+    // only the arena whose chunk ends at the break can give memory back
+    if ((char *)arena->epilogue + wsize == (char *)mem_heap_hi() + 1 &&
+        keep < size)
+    {
+        remove_block(block);
+        write_header(block, keep, false);
+        write_footer(block, keep, false);
+        add_free_block(block);
+
+        block_t *epilogue = find_next(block);
+        write_word(&epilogue->header, pack(0, true, false, false, false));
+        forget_blocks(block, arena->epilogue);
+        arena->epilogue = epilogue;
+        mem_sbrk(-(intptr_t)(size - keep));
+        count_stat(arena, stat_heap_trims, 1);
+        arena->trimmed = true;
+        // the released pages read as zero again
+        char *fresh = mem_fresh_lo();
+        if (zero_frontier > fresh)
+        {
+            __atomic_store_n(&zero_frontier, fresh, __ATOMIC_RELAXED);
+        }
+    }
+    unlock_sbrk();
+}
+#endif
+
+#if MM_MMAP_THRESHOLD > 0
+/*
+ * map_block: Allocates a block of at least size bytes in a region of its
+ *            own, with its payload aligned to align bytes, a power of two
+ *            no smaller than dsize. The block starts one word past the
+ *            first align boundary that leaves room for that word, and ends
+ *            one word before the region ends. The word before the header
+ *            holds the distance from the region start to that word, which
+ *            is 0 unless align is larger than dsize.
+ */
+static void *map_block(size_t size, size_t align)
+{
+    size_t asize = round_up(size + wsize, dsize);
+    size_t len = round_up(asize + max(align, dsize), mem_pagesize());
+    char *region;
+
+    lock_sbrk();
+    region = mem_map(len);
+    unlock_sbrk();
+    if (region == (void *)-1)
+    {
+        return NULL;
+    }
+
+    size_t bp = round_up((size_t)region + dsize, align);
+    size_t lead = bp - dsize - (size_t)region;
+    block_t *block = payload_to_header((void *)bp);
+    *((word_t *)block - 1) = lead;
+    block->header = pack(len - dsize - lead, true, true, false, false);
+    return header_to_payload(block);
+}
+
+/*
+ * unmap_block: Returns the region of a mapped block to the system.
+ */
+static void unmap_block(block_t *block)
+{
+    size_t lead = *((word_t *)block - 1);
+    lock_sbrk();
+    mem_unmap((char *)block - wsize - lead, get_size(block) + dsize + lead);
+    unlock_sbrk();
+}
+
+/*
+ * is_mapped: returns true if bp is the payload of a mapped block. memlib
+ *            reserves the whole heap range up front, so mappings always lie
+ *            outside it.
+ */
+static bool is_mapped(void *bp)
+{
+    return (char *)bp < (char *)mem_heap_lo() ||
+           (char *)bp > (char *)mem_heap_hi();
+}
+#endif
+
+/*
+ * thread_arena_get: Returns the arena the calling thread allocates from.
+ *                   Threads are assigned round-robin on their first request.
+ */
+static arena_t *thread_arena_get(void)
+{
+#if MM_ARENAS > 1
+    if (thread_arena == NULL)
+    {
+        unsigned int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena_set(&arenas[i % MM_ARENAS]);
+#if MM_REMOTE_FREE
+        pthread_once(&arena_key_once, arena_key_create);
+        pthread_setspecific(arena_key, thread_arena);
+#endif
+    }
+    return thread_arena;
+#else
+    return &arenas[0];
+#endif
+}
+
+#if MM_ARENAS > 1
+/*
+ * thread_arena_set: Moves the calling thread to arena, or to none if arena
+ *                   is NULL, keeping count of the threads in each arena.
+ *                   Returns the arena the thread left, if it was the last
+ *                   one there, so the caller can empty its remote queue.
+ */
+static arena_t *thread_arena_set(arena_t *arena)
+{
+#if MM_REMOTE_FREE
+    arena_t *old = thread_arena;
+
+    thread_arena = arena;
+    if (arena != NULL)
+    {
+        __atomic_fetch_add(&arena->users, 1, __ATOMIC_RELAXED);
+    }
+    if (old != NULL &&
+        __atomic_sub_fetch(&old->users, 1, __ATOMIC_RELAXED) <= 0)
+    {
+        return old;
+    }
+#else
+    thread_arena = arena;
+#endif
+    return NULL;
+}
+#endif
+
+/*
+ * lock_arena: Acquires the lock protecting an arena's free lists, counting
+ *             the acquisitions that had to wait. A thread that waits on its
+ *             own arena moves to the least contended one for later requests.
+ *             Returns true if the lock was contended. Compiles to nothing
+ *             unless the allocator is built with MM_THREADS.
+ */
+static bool lock_arena(arena_t *arena)
+{
+#if MM_THREADS
+    if (pthread_mutex_trylock(&arena->mutex) == 0)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&arena->mutex);
+    ++arena->contention;
+#if MM_ARENAS > 1
+    if (arena == thread_arena)
+    {
+        arena_t *least = arena;
+        int i;
+        for(i=0; i<MM_ARENAS; ++i)
+        {
+            if (arenas[i].contention < least->contention)
+            {
+                least = &arenas[i];
+            }
+        }
+        if (least != arena)
+        {
+#if MM_REMOTE_FREE
+            // the lock is held, so empty a queue no thread is left to drain
+            if (thread_arena_set(least) != NULL)
+            {
+                remote_drain(arena);
+            }
+#else
+            thread_arena_set(least);
+#endif
+        }
+    }
+#endif
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * unlock_arena: Releases the lock taken by lock_arena.
+ */
+static void unlock_arena(arena_t *arena)
+{
+#if MM_THREADS
+    pthread_mutex_unlock(&arena->mutex);
+#endif
+}
+
+/*
+ * lock_sbrk: Acquires the lock protecting the memlib break. Taken while
+ *            holding an arena lock, never the other way around.
+ */
+static void lock_sbrk(void)
+{
+#if MM_THREADS
+    pthread_mutex_lock(&sbrk_mutex);
+#endif
+}
+
+/*
+ * unlock_sbrk: Releases the lock taken by lock_sbrk.
+ */
+static void unlock_sbrk(void)
+{
+#if MM_THREADS
+    pthread_mutex_unlock(&sbrk_mutex);
+#endif
+}
+
+/*
+ * mm_arena_count: returns the number of arenas the allocator was built with
+ */
+int mm_arena_count(void)
+{
+    return MM_ARENAS;
+}
+
+/*
+ * mm_arena_contention: returns how many lock acquisitions of arena i had to
+ *                      wait since mm_init. Always 0 without MM_THREADS.
+ */
+unsigned long mm_arena_contention(int i)
+{
+#if MM_THREADS
+    return arenas[i].contention;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * mm_stats: Adds up the counters of every arena since mm_init, and counts
+ *           the blocks and bytes in each free list and in the size tree.
+ *           Blocks parked in fast bins or thread caches are not free as far
+ *           as the lists are concerned, so they are not counted. Returns
+ *           false without filling in stats unless the allocator is built
+ *           with MM_STATS.
+ */
+bool mm_stats(mm_stats_t *stats)
+{
+#if MM_STATS
+    int i, j;
+
+    memset(stats, 0, sizeof(mm_stats_t));
+    stats->classes = num_seg_lists;
+    if (heap_start == NULL)
+    {
+        return true;
+    }
+
+    for (i = 0; i < MM_ARENAS; ++i)
+    {
+        arena_t *arena = &arenas[i];
+        lock_arena(arena);
+        stats->mallocs += arena->stats[stat_mallocs];
+        stats->frees += arena->stats[stat_frees];
+        stats->reallocs += arena->stats[stat_reallocs];
+        stats->fit_searches += arena->stats[stat_fit_searches];
+        stats->fit_candidates += arena->stats[stat_fit_candidates];
+        stats->splits += arena->stats[stat_splits];
+        stats->exact_fits += arena->stats[stat_exact_fits];
+        stats->coalesce_none += arena->stats[stat_coalesce_none];
+        stats->coalesce_next += arena->stats[stat_coalesce_next];
+        stats->coalesce_prev += arena->stats[stat_coalesce_prev];
+        stats->coalesce_both += arena->stats[stat_coalesce_both];
+        stats->heap_extends += arena->stats[stat_heap_extends];
+        stats->heap_trims += arena->stats[stat_heap_trims];
+        stats->fit_cycles += arena->stats[stat_fit_cycles];
+        stats->purges += arena->stats[stat_purges];
+        stats->purged_bytes += arena->stats[stat_purged_bytes];
+        stats->remote_frees += arena->stats[stat_remote_frees];
+
+        for (j = 0; j < num_seg_lists; ++j)
+        {
+            block_t *block = arena->free_ptr_list[j];
+            if (block == NULL)
+            {
+                continue;
+            }
+            do
+            {
+                stats->class_blocks[j]++;
+                stats->class_bytes[j] += get_size(block);
+                block = find_next_free(block);
+            } while (block != arena->free_ptr_list[j]);
+        }
+#if MM_TREE
+        stats_tree(arena->tree_root, stats);
+#endif
+        unlock_arena(arena);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if MM_STATS && MM_TREE
+/*
+ * stats_tree: Counts the blocks of a size subtree in the classes of the
+ *             lists they would be in without the tree.
+ */
+static void stats_tree(block_t *root, mm_stats_t *stats)
+{
+    while (root != NULL)
+    {
+        int j = find_list(get_size(root));
+        stats->class_blocks[j]++;
+        stats->class_bytes[j] += get_size(root);
+        stats_tree(root->payload.tree_node.left, stats);
+        root = root->payload.tree_node.right;
+    }
+}
+#endif
+
+/*
+ * count_stat: Adds n to one of an arena's counters. Caller must hold the
+ *             arena lock. Compiles to nothing without MM_STATS.
+ */
+static void count_stat(arena_t *arena, stat_t stat, unsigned long n)
+{
+#if MM_STATS
+    arena->stats[stat] += n;
+#endif
+}
+
+/*
+ * count_call: Adds n to a request counter of the calling thread's arena.
+ *             Requests served from a thread cache do not take the arena
+ *             lock, so the counters are updated atomically with threads.
+ *             Compiles to nothing without MM_STATS.
+ */
+static void count_call(stat_t stat, unsigned long n)
+{
+#if MM_STATS
+    arena_t *arena = thread_arena_get();
+#if MM_THREADS
+    __atomic_fetch_add(&arena->stats[stat], n, __ATOMIC_RELAXED);
+#else
+    arena->stats[stat] += n;
+#endif
+#endif
+}
+
+#if MM_FASTBINS
+/*
+ * fastbin_pop: Takes a parked block of exactly asize bytes from the arena's
+ *              fast bins, or returns NULL if the bin is empty. Caller must
+ *              hold the arena lock.
+ */
+static block_t *fastbin_pop(arena_t *arena, size_t asize)
+{
+    int bin = asize / dsize - 1;
+    block_t *block = arena->fastbin[bin];
+
+    if (block != NULL)
+    {
+        arena->fastbin[bin] = block->payload.parked_next;
+        if (arena->fastbin[bin] == NULL)
+        {
+            arena->fastbin_map &= ~(1u << bin);
+        }
+    }
+    return block;
+}
+
+/*
+ * fastbin_push: Parks an allocated block in the arena's fast bins instead of
+ *               freeing it. Caller must hold the arena lock.
+ */
+static void fastbin_push(arena_t *arena, block_t *block)
+{
+    int bin = get_size(block) / dsize - 1;
+
+    block->payload.parked_next = arena->fastbin[bin];
+    arena->fastbin[bin] = block;
+    arena->fastbin_map |= 1u << bin;
+}
+
+/*
+ * fastbin_consolidate: Frees every block parked in the arena's fast bins,
+ *                      coalescing them with their neighbours. Returns false
+ *                      if the bins were already empty. Caller must hold the
+ *                      arena lock.
+ */
+static bool fastbin_consolidate(arena_t *arena)
+{
+    if (arena->fastbin_map == 0)
+    {
+        return false;
+    }
+
+    while (arena->fastbin_map != 0)
+    {
+        int bin = __builtin_ctz(arena->fastbin_map);
+        block_t *block = arena->fastbin[bin];
+        while (block != NULL)
+        {
+            block_t *next = block->payload.parked_next;
+            free_block(block);
+            block = next;
+        }
+        arena->fastbin[bin] = NULL;
+        arena->fastbin_map &= ~(1u << bin);
+    }
+    return true;
+}
+#endif
+
+#if MM_TCACHE
+/*
+ * tcache_get: Returns the calling thread's cache, emptying it first if its
+ *             blocks belong to a heap that mm_init has since thrown away.
+ *             A thread's first use registers the cache to be flushed when
+ *             the thread exits.
+ */
+static tcache_t *tcache_get(void)
+{
+    tcache_t *tc = &tcache;
+    if (tc->epoch != heap_epoch)
+    {
+        memset(tc, 0, sizeof(tcache_t));
+        // set first: pthread_setspecific may itself allocate
+        tc->epoch = heap_epoch;
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/*
+ * tcache_flush: Frees the top n blocks of a cache bin, taking each arena
+ *               lock once for a run of blocks from the same arena.
+ */
+static void tcache_flush(tcache_t *tc, int bin, unsigned int n)
+{
+    arena_t *locked = NULL;
+    unsigned int i;
+
+    for(i=0; i<n; ++i)
+    {
+        block_t *victim = tc->head[bin];
+        arena_t *arena = get_arena(victim);
+        tc->head[bin] = victim->payload.parked_next;
+#if MM_REMOTE_FREE
+        if (is_remote(arena))
+        {
+            remote_push(arena, victim);
+            continue;
+        }
+#endif
+        if (arena != locked)
+        {
+            if (locked != NULL)
+            {
+                unlock_arena(locked);
+            }
+            lock_arena(arena);
+#if MM_REMOTE_FREE
+            remote_drain(arena);
+#endif
+            locked = arena;
+        }
+        free_block(victim);
+    }
+    if (locked != NULL)
+    {
+        unlock_arena(locked);
+    }
+    tc->count[bin] -= n;
+}
+
+/*
+ * tcache_key_create: Creates the key whose destructor is tcache_exit
+ */
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * tcache_exit: Returns every block in an exiting thread's cache to the
+ *              heap, unless the heap has been reset since it was filled.
+ */
+static void tcache_exit(void *arg)
+{
+    tcache_t *tc = arg;
+    int bin;
+
+    if (tc->epoch != heap_epoch)
+    {
+        return;
+    }
+    for(bin=0; bin<tcache_bins; ++bin)
+    {
+        tcache_flush(tc, bin, tc->count[bin]);
+    }
+    // a later destructor that frees registers the cache again
+    tc->epoch = 0;
+}
+
+/*
+ * tcache_malloc: Serves a small request from the thread cache. On a miss,
+ *                allocates tcache_batch blocks of asize under a single lock
+ *                acquisition, returns one and caches the rest.
+ */
+static void *tcache_malloc(size_t asize)
+{
+    tcache_t *tc = tcache_get();
+    int bin = asize / dsize - 1;
+    block_t *block = tc->head[bin];
+    unsigned int i;
+
+    if (block == NULL)
+    {
+        arena_t *arena = thread_arena_get();
+        lock_arena(arena);
+        for(i=0; i<tcache_batch; ++i)
+        {
+            block = alloc_block(arena, asize, NULL);
+            if (block == NULL)
+            {
+                break;
+            }
+            block->payload.parked_next = tc->head[bin];
+            tc->head[bin] = block;
+            ++tc->count[bin];
+        }
+        unlock_arena(arena);
+
+        block = tc->head[bin];
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    tc->head[bin] = block->payload.parked_next;
+    --tc->count[bin];
+    return header_to_payload(block);
+}
+
+/*
+ * tcache_free: Parks a small block in the thread cache. If its bin is full,
+ *              first returns tcache_batch cached blocks to their arenas,
+ *              taking each arena lock once per run of blocks it owns.
+ */
+static void tcache_free(block_t *block, size_t size)
+{
+    tcache_t *tc = tcache_get();
+    int bin = size / dsize - 1;
+
+    if (tc->count[bin] >= tcache_max_count)
+    {
+        tcache_flush(tc, bin, tcache_batch);
+    }
+
+    block->payload.parked_next = tc->head[bin];
+    tc->head[bin] = block;
+    ++tc->count[bin];
+}
+#endif
+
+#if MM_SLAB
+/*
+ * slab_malloc: Returns a free slot of the smallest class that holds size
+ *              bytes, starting a new run if the class has no free slots.
+ *              Returns NULL if no run could be made. Caller must hold the
+ *              arena lock.
+ */
+static void *slab_malloc(arena_t *arena, size_t size)
+{
+    int cls = (size - 1) / dsize;
+    slab_run_t *run = arena->slab_partial[cls];
+    int w = 0;
+
+    if (run == NULL)
+    {
+        run = slab_new_run(arena, cls);
+        if (run == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    // runs on the partial list always have a clear bit
+    while (~run->bitmap[w] == 0)
+    {
+        ++w;
+    }
+    int bit = __builtin_ctzl(~run->bitmap[w]);
+    run->bitmap[w] |= (word_t)1 << bit;
+    if (--run->nfree == 0)
+    {
+        slab_unlink(arena, run);
+    }
+    return (char *)run + slab_slot_offset + (w*64 + bit) * run->slot_size;
+}
+
+/*
+ * slab_free: Releases the slot at bp. A run that becomes empty is returned
+ *            to the heap unless it is the only run of its class with free
+ *            slots, so a class that allocates and frees one slot at a time
+ *            keeps its run. That spare run goes back as soon as another run
+ *            of the class gets a free slot. Caller must hold the lock of the
+ *            run's arena.
+ */
+static void slab_free(slab_run_t *run, void *bp)
+{
+    arena_t *arena = get_arena(payload_to_header(run));
+    size_t slot = ((char *)bp - (char *)run - slab_slot_offset) / run->slot_size;
+
+    dbg_requires(run->bitmap[slot / 64] & ((word_t)1 << (slot % 64)));
+    run->bitmap[slot / 64] &= ~((word_t)1 << (slot % 64));
+    if (run->nfree++ == 0)
+    {
+        // an empty run is only kept alone, so it can only be the head
+        slab_run_t *spare = arena->slab_partial[run->slot_size / dsize - 1];
+        slab_push(arena, run);
+        if (spare != NULL && spare->nfree == spare->nslots)
+        {
+            slab_release(arena, spare);
+        }
+    }
+    else if (run->nfree == run->nslots &&
+             (run->prev != NULL || run->next != NULL))
+    {
+        slab_release(arena, run);
+    }
+}
+
+/*
+ * slab_release: Takes an empty run off its partial list and returns it to
+ *               the heap.
+ */
+static void slab_release(arena_t *arena, slab_run_t *run)
+{
+    slab_unlink(arena, run);
+    slab_mark_page(run, false);
+    free_block(payload_to_header(run));
+}
+
+/*
+ * slab_new_run: Carves a page aligned run for class cls out of the arena and
+ *               puts it on the class's partial list.
+ */
+static slab_run_t *slab_new_run(arena_t *arena, int cls)
+{
+    block_t *block = alloc_aligned_block(arena, slab_run_size, slab_run_size);
+    int i;
+
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    slab_run_t *run = header_to_payload(block);
+    if ((size_t)((char *)run - (char *)mem_heap_lo()) / slab_run_size >=
+        slab_page_count)
+    {
+        // past the end of the page map
+        free_block(block);
+        return NULL;
+    }
+
+    run->slot_size = (cls + 1) * dsize;
+    run->nslots = (get_payload_size(block) - slab_slot_offset) / run->slot_size;
+    run->nfree = run->nslots;
+    for(i=0; i<slab_map_words; ++i)
+    {
+        int used = run->nslots - i*64; // slots of this word that exist
+        if (used >= 64)
+            run->bitmap[i] = 0;
+        else if (used <= 0)
+            run->bitmap[i] = ~(word_t)0;
+        else
+            run->bitmap[i] = ~(word_t)0 << used;
+    }
+    run->next = run->prev = NULL;
+    slab_push(arena, run);
+    slab_mark_page(run, true);
+    return run;
+}
+
+/*
+ * slab_find_run: Returns the run containing bp, or NULL if bp is the payload
+ *                of an ordinary block.
+ */
+static slab_run_t *slab_find_run(void *bp)
+{
+    size_t page = (size_t)((char *)bp - (char *)mem_heap_lo()) / slab_run_size;
+    if (page >= slab_page_count)
+    {
+        return NULL;
+    }
+    word_t bits = __atomic_load_n(&slab_pages[page / 64], __ATOMIC_RELAXED);
+    if (!((bits >> (page % 64)) & 1))
+    {
+        return NULL;
+    }
+    return (slab_run_t *)((size_t)bp & ~(slab_run_size - 1));
+}
+
+/*
+ * slab_mark_page: Sets or clears the page map bit of a run. Other arenas
+ *                 update neighbouring bits under their own locks, so the
+ *                 update is atomic.
+ */
+static void slab_mark_page(slab_run_t *run, bool is_run)
+{
+    size_t page = (size_t)((char *)run - (char *)mem_heap_lo()) / slab_run_size;
+    word_t bit = (word_t)1 << (page % 64);
+    if (is_run)
+        __atomic_fetch_or(&slab_pages[page / 64], bit, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&slab_pages[page / 64], ~bit, __ATOMIC_RELAXED);
+}
+
+/*
+ * slab_push: adds a run to the front of its class's partial list
+ */
+static void slab_push(arena_t *arena, slab_run_t *run)
+{
+    int cls = run->slot_size / dsize - 1;
+    run->prev = NULL;
+    run->next = arena->slab_partial[cls];
+    if (run->next != NULL)
+    {
+        run->next->prev = run;
+    }
+    arena->slab_partial[cls] = run;
+}
+
+/*
+ * slab_unlink: removes a run from its class's partial list
+ */
+static void slab_unlink(arena_t *arena, slab_run_t *run)
+{
+    int cls = run->slot_size / dsize - 1;
+    if (run->prev != NULL)
+        run->prev->next = run->next;
+    else
+        arena->slab_partial[cls] = run->next;
+    if (run->next != NULL)
+    {
+        run->next->prev = run->prev;
+    }
+    run->next = run->prev = NULL;
+}
+#endif
+
+/*
+ * extend_heap: Extends arena by size bytes. Uses sbrk. If the arena's last
+ *              chunk ends at the break, the chunk grows in place over its
+ *              epilogue; otherwise a new chunk with its own prologue footer
+ *              and epilogue is started.
+ */
+static block_t *extend_heap(arena_t *arena, size_t size)
+{
+    void *bp;
+    block_t *block;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+
+    lock_sbrk();
+    bool in_place = arena->epilogue != NULL &&
+        (char *)arena->epilogue + wsize == (char *)mem_heap_hi() + 1;
+    // take the rest of memlib's granule too, so no huge page is left part
+    // used below the break
+    size_t granule = mem_granule();
+    if (granule > dsize)
+    {
+        size_t brk = mem_heapsize() + size + (in_place ? 0 : dsize);
+        size += round_up(brk, granule) - brk;
+    }
+#if MM_COMPACT_LINKS
+    if (mem_heapsize() + size + dsize > link_reach)
+    {
+        unlock_sbrk();
+        errno = ENOMEM;
+        return NULL;
+    }
+#endif
+    if (in_place)
+    {
+        if ((bp = mem_sbrk(size)) == (void *)-1)
+        {
+            unlock_sbrk();
+            return NULL;
+        }
+        block = payload_to_header(bp);
+    }
+    else
+    {
+        if ((bp = mem_sbrk(size + dsize)) == (void *)-1)
+        {
+            unlock_sbrk();
+            return NULL;
+        }
+        // Prologue footer, then a header that reads like an epilogue
+        // following an allocated block
+        write_word(bp, pack(0, true, false, false, false));
+        block = (block_t *)((char *)bp + wsize);
+        write_word(&block->header, pack(0, true, true, false, false));
+    }
+    unlock_sbrk();
+    count_stat(arena, stat_heap_extends, 1);
+#if MM_TRIM_THRESHOLD > 0
+    if (arena->trimmed)
+    {
+        // the last trim gave back memory that is needed again
+        arena->trimmed = false;
+        if (arena->trim_extra < size)
+        {
+            arena->trim_extra = size < trim_extra_max ? size : trim_extra_max;
+        }
+    }
+#endif
+
+    // Initialize free block header/footer
+    write_header(block, size, false);
+    write_arena(block, arena);
+    write_footer(block, size, false);
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_header(block_next, 0, true);
+    update_prev_alloc(block_next, false);
+    update_prev_sblock(block_next, false);
+    arena->epilogue = block_next;
+
+    // Coalesce in case the neighboring blocks are free
+    block_t *merged = coalesce(block);
+    if (merged != block)
+    {
+        // the old footer and epilogue are now inside the free block, which
+        // may lie above the zero frontier, unless they are its links
+        word_t *stale = (word_t *)block - 1;
+        word_t *links_end = (word_t *)((char *)header_to_payload(merged) +
+                                       sizeof(payload_t));
+        for (; stale <= (word_t *)block; ++stale)
+        {
+            if (stale >= links_end)
+            {
+                write_word(stale, 0);
+            }
+        }
+    }
+    return merged;
+}
+
+/*
+ * coalesce: Coalesces (and frees) a block with any already free adjacent
+ *           blocks. Returns a pointer to the beginning of that block.
+ */
+static block_t *coalesce(block_t * block)
+{
+    bool coalesced = false;
+    block_t* new_block = block;
+    size_t size = get_size(block);
+    stat_t outcome = stat_coalesce_none;
+
+    // checking previous
+    if(!get_prev_alloc(block))
+    {
+        word_t* prev_footer = find_prev_footer(block);
+        if(!extract_alloc(read_word(prev_footer))) {
+            size += extract_size(read_word(prev_footer));
+            new_block = find_prev(block);
+            remove_block(new_block);
+            coalesced=true;
+            outcome = stat_coalesce_prev;
+        }
+    }
+
+    block_t* next_block = find_next(block);
+    // checking next
+    if(!get_alloc(next_block))
+    {
+        size += get_size(next_block);
+        remove_block(next_block);
+        outcome = coalesced ? stat_coalesce_both : stat_coalesce_next;
+        coalesced=true;
+    }
+
+    write_header(new_block, size, false);
+    write_footer(new_block, size, false);
+
+    // adding free block
+    add_free_block(new_block);
+
+    if(coalesced)
+    {
+        // updating prev_sblock
+        next_block=find_next(new_block);
+        // if were coalescing, the resulting block is never small
+        update_prev_sblock(next_block, false);
+        forget_blocks(new_block, next_block);
+    }
+
+    count_stat(get_arena(new_block), outcome, 1);
+    return new_block;
+}
+
+/*
+ * place: Places block in heap. Updates headers and footers for blocks
+ */
+static void place(block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);
+    block_t *block_next; // pointer to next block in memory
+
+    // if we can split the block
+    if ((csize - asize) >= min_block_size)
+    {
+        remove_block(block);
+        write_header(block, asize, true);
+        // clearing old footer
+        write_word((char*)block+get_size(block), 0);
+
+        // the new block split must be free
+        block_next = find_next(block);
+        write_header(block_next, csize-asize, false);
+        write_arena(block_next, get_arena(block));
+        write_footer(block_next, csize-asize, false);
+        update_prev_alloc(block_next, true);
+        update_prev_sblock(block_next, asize==min_block_size ? true:false);
+
+        //------updating pointers given new block-------
+        // Adding newly freed block to list
+        add_free_block(block_next);
+
+        // updating prev_sblock bit in the next next block if the split block
+        // is small
+        block_next = find_next(block_next);
+        update_prev_sblock(block_next, csize-asize==min_block_size ? true:false);
+        count_stat(get_arena(block), stat_splits, 1);
+    }
+    else
+    {
+        // removing block from list
+        remove_block(block);
+
+        // writing new header
+        write_header(block, csize, true);
+
+        block_next = find_next(block);
+        update_prev_alloc(block_next, true);
+        update_prev_sblock(block_next, csize==min_block_size ? true:false);
+        count_stat(get_arena(block), stat_exact_fits, 1);
+    }
+
+    raise_zero_frontier(block);
+}
+
+/*
+ * dirty_bytes: Returns how many leading payload bytes of a free block about
+ *              to be placed may hold old data: everything below the zero
+ *              frontier, and at least the free list links.
+ */
+static size_t dirty_bytes(block_t *block)
+{
+    char *bp = header_to_payload(block);
+    char *frontier = __atomic_load_n(&zero_frontier, __ATOMIC_RELAXED);
+    size_t dirty = frontier > bp ? (size_t)(frontier - bp) : 0;
+    return max(dirty, sizeof(payload_t));
+}
+
+/*
+ * raise_zero_frontier: Moves the zero frontier past a block being handed
+ *                      out, and past the header and links of a free block
+ *                      split off after it. Other arenas raise it
+ *                      concurrently, so the update is atomic.
+ */
+static void raise_zero_frontier(block_t *block)
+{
+    char *end = (char *)block + get_size(block) + wsize + sizeof(payload_t);
+    char *frontier = __atomic_load_n(&zero_frontier, __ATOMIC_RELAXED);
+    while (frontier < end &&
+           !__atomic_compare_exchange_n(&zero_frontier, &frontier, end, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/*
+ * find_fit: Given a size in bytes, finds a block in the heap that is large
+ *           enough to fit the data. Returns a pointer to the block, or NULL if
+ *           no block can fit the data. With MM_STATS_CYCLES, the search is
+ *           timed in time stamp counter cycles.
+ */
+static block_t *find_fit(arena_t *arena, size_t asize)
+{
+#if MM_STATS_CYCLES
+    unsigned long start = read_cycles();
+    block_t *block = search_fit(arena, asize);
+    count_stat(arena, stat_fit_searches, 1);
+    count_stat(arena, stat_fit_cycles, read_cycles() - start);
+    return block;
+#else
+    count_stat(arena, stat_fit_searches, 1);
+    return search_fit(arena, asize);
+#endif
+}
+
+/*
+ * search_fit: The search behind find_fit. Walks the lists from the class of
+ *             asize up and takes the smallest of the first num_candidates
+ *             blocks that fit.
+ */
+static block_t *search_fit(arena_t *arena, size_t asize)
+{
+#if MM_TLSF
+    return tlsf_find_fit(arena, asize);
+#else
+    int i;
+    int seg_index = find_list(asize);
+    block_t *best_block = NULL;
+    size_t min_size = mem_heapsize();
+    int num_read = 0;
+    unsigned long examined = 0; // blocks looked at, for the counters
+    int last_list = num_seg_lists;
+#if MM_TREE
+    // the lists from MM_TREE_MIN up are empty; their blocks are in the tree
+    last_list = find_list(MM_TREE_MIN);
+#endif
+
+    for(i=seg_index; i<last_list; ++i) {
+        block_t *head = arena->free_ptr_list[i];
+        block_t *block = head;
+        // if the list is empty (head is null) don't look in it
+        if(block == NULL)
+        {
+            continue;
+        }
+#if MM_FIT_CACHE
+        if(i >= fit_cache_first)
+        {
+            // the cached sizes stand in for the first blocks of the list
+            fit_cache_t *cache = &arena->fit_cache[i];
+            unsigned int j;
+            for(j=0; j<cache->count; ++j)
+            {
+                ++examined;
+                if(fit_candidate(cache->block[j], cache->size[j], asize,
+                                 &best_block, &min_size, &num_read))
+                {
+                    count_stat(arena, stat_fit_candidates, examined);
+                    return best_block;
+                }
+            }
+            if(cache->count == cache->length)
+            {
+                continue;
+            }
+            block = find_next_free(cache->block[cache->count - 1]);
+        }
+#endif
+#if MM_PREFETCH
+        block_t *ahead = block;
+        int k;
+        for(k=0; k<MM_PREFETCH; ++k)
+        {
+            ahead = find_next_free(ahead);
+            __builtin_prefetch(ahead);
+        }
+#endif
+        do
+        {
+            ++examined;
+            if(fit_candidate(block, get_size(block), asize,
+                             &best_block, &min_size, &num_read))
+            {
+                count_stat(arena, stat_fit_candidates, examined);
+                return best_block;
+            }
+#if MM_PREFETCH
+            // keep the prefetch MM_PREFETCH links ahead of the next block
+            ahead = find_next_free(ahead);
+            __builtin_prefetch(ahead);
+#endif
+            block = find_next_free(block);
+        } while(block != head);
+    }
+    count_stat(arena, stat_fit_candidates, examined);
+
+#if MM_TREE
+    if(best_block == NULL)
+    {
+        return tree_find_fit(arena, asize);
+    }
+#endif
+    // best block will be NULL if no fit was found, but the best fit if no other
+    // fit was found
+    return best_block;
+#endif
+}
+
+#if !MM_TLSF
+/*
+ * fit_candidate: Makes block, of size bytes, the best fit so far if it holds
+ *                asize bytes and is smaller than the best. Returns true once
+ *                num_candidates blocks that fit have been seen.
+ */
+static bool fit_candidate(block_t *block, size_t size, size_t asize,
+                          block_t **best_block, size_t *min_size, int *num_read)
+{
+    if (asize <= size)
+    {
+        if(size < *min_size)
+        {
+            *min_size = size;
+            *best_block = block;
+        }
+        ++*num_read;
+    }
+    return *num_read >= num_candidates;
+}
+#endif
+
+/*
+ * read_cycles: Returns the time stamp counter, or 0 where there is none.
+ *              Used only to time find_fit with MM_STATS_CYCLES.
+ */
+static unsigned long read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * add_free_block: adds free block to the explicit list using a LIFO policy.
+ *                 Returns header of list the block was added to.
+ */
+static int add_free_block(block_t *block) {
+    // finding which list to add to based on size
+    block_t* free_ptr;
+    arena_t *arena = get_arena(block);
+    int seg_index = find_list(get_size(block));
+#if MM_PURGE_DECAY > 0
+    if(get_size(block) >= MM_PURGE_MIN)
+    {
+        purge_enqueue(arena, block);
+    }
+#endif
+#if MM_TREE
+    if(in_tree(get_size(block)))
+    {
+        tree_insert(arena, block);
+        return seg_index;
+    }
+#endif
+    free_ptr = arena->free_ptr_list[seg_index];
+    if(free_ptr == NULL)
+    {
+        initialize_list(block, seg_index);
+#if MM_TLSF
+        tlsf_set_bit(arena, seg_index);
+#endif
+    }
+    else
+    {
+        // adding the element
+        write_next_ptr(block, free_ptr);
+        write_prev_ptr(block, find_prev_ptr(free_ptr));
+        block_t* prev = find_prev_ptr(free_ptr);
+        write_next_ptr(prev, block);
+        write_prev_ptr(free_ptr, block);
+        if(free_ptr == find_next_free(free_ptr))
+            write_next_ptr(free_ptr, block);
+    }
+#if MM_FIT_CACHE
+    if(seg_index >= fit_cache_first)
+    {
+        fit_cache_add(arena, seg_index, block);
+    }
+#endif
+    return seg_index;
+}
+
+/*
+ * remove_block: removes block from the list and updates the neighboring nodes
+ *               accordingly. This method only unlinks pointers, and does not
+ *               overwrite them in memory.
+ */
+static void remove_block(block_t *block)
+{
+    arena_t *arena = get_arena(block);
+#if MM_PURGE_DECAY > 0
+    if(get_size(block) >= MM_PURGE_MIN)
+    {
+        purge_dequeue(arena, block);
+    }
+#endif
+#if MM_TREE
+    if(in_tree(get_size(block)))
+    {
+        tree_remove(arena, block);
+        return;
+    }
+#endif
+    int seg_index = find_list(get_size(block));
+    block_t* free_ptr = arena->free_ptr_list[seg_index];
+
+    if(block == free_ptr && free_ptr == find_next_free(free_ptr)) {
+        arena->free_ptr_list[seg_index] = NULL;
+#if MM_TLSF
+        tlsf_clear_bit(arena, seg_index);
+#endif
+    }
+    else {
+        if(block == free_ptr)
+            arena->free_ptr_list[seg_index] = find_next_free(block);
+        block_t* next_blk = find_next_free(block);
+        block_t* prev_blk = find_prev_ptr(block);
+
+        write_prev_ptr(next_blk, prev_blk);
+        write_next_ptr(prev_blk, next_blk);
+    }
+#if MM_FIT_CACHE
+    if(seg_index >= fit_cache_first)
+    {
+        fit_cache_remove(arena, seg_index, block);
+    }
+#endif
+    // --free_count;
+}
+
+#if MM_PURGE_DECAY > 0
+/*
+ * purge_tag: Returns the purge tag of a free block of at least MM_PURGE_MIN
+ *            bytes, which ends where its footer starts.
+ */
+static purge_tag_t *purge_tag(block_t *block)
+{
+    return (purge_tag_t *)((char *)block + get_size(block) - wsize -
+                           sizeof(purge_tag_t));
+}
+
+/*
+ * purge_enqueue: Stamps a large block joining the free lists with the arena
+ *                clock and queues it behind the blocks freed before it.
+ */
+static void purge_enqueue(arena_t *arena, block_t *block)
+{
+    purge_tag_t *tag = purge_tag(block);
+    write_word(&tag->next, 0);
+    write_word(&tag->prev, (word_t)arena->purge_tail);
+    write_word(&tag->stamp, arena->purge_clock);
+    if(arena->purge_tail != NULL)
+    {
+        write_word(&purge_tag(arena->purge_tail)->next, (word_t)block);
+    }
+    else
+    {
+        arena->purge_head = block;
+    }
+    arena->purge_tail = block;
+}
+
+/*
+ * purge_dequeue: Takes a large block leaving the free lists out of the
+ *                purge queue, unless it was purged already. The tag is
+ *                cleared, since it may end up in a block calloc assumes
+ *                reads as zero.
+ */
+static void purge_dequeue(arena_t *arena, block_t *block)
+{
+    purge_tag_t *tag = purge_tag(block);
+    if(read_word(&tag->stamp) != purge_done)
+    {
+        purge_unlink(arena, tag);
+    }
+    write_word(&tag->next, 0);
+    write_word(&tag->prev, 0);
+    write_word(&tag->stamp, 0);
+}
+
+/*
+ * purge_unlink: Unlinks the block owning tag from the purge queue.
+ */
+static void purge_unlink(arena_t *arena, purge_tag_t *tag)
+{
+    block_t *next = (block_t *)read_word(&tag->next);
+    block_t *prev = (block_t *)read_word(&tag->prev);
+    if(next != NULL)
+    {
+        write_word(&purge_tag(next)->prev, (word_t)prev);
+    }
+    else
+    {
+        arena->purge_tail = prev;
+    }
+    if(prev != NULL)
+    {
+        write_word(&purge_tag(prev)->next, (word_t)next);
+    }
+    else
+    {
+        arena->purge_head = next;
+    }
+}
+
+/*
+ * purge_tick: Advances the arena clock by one operation, then purges the
+ *             blocks at the head of the queue that have been free for
+ *             MM_PURGE_DECAY operations. The queue is in stamp order, so
+ *             the first younger block ends the scan. Caller must hold the
+ *             arena lock.
+ */
+static void purge_tick(arena_t *arena)
+{
+    block_t *block;
+
+    ++arena->purge_clock;
+    while((block = arena->purge_head) != NULL)
+    {
+        purge_tag_t *tag = purge_tag(block);
+        if(arena->purge_clock - read_word(&tag->stamp) < MM_PURGE_DECAY)
+        {
+            break;
+        }
+        purge_unlink(arena, tag);
+        write_word(&tag->stamp, purge_done);
+        // everything between the links and the tag may go
+        size_t bytes = mem_purge((char *)header_to_payload(block) +
+                                 sizeof(payload_t), tag);
+        count_stat(arena, stat_purges, bytes != 0);
+        count_stat(arena, stat_purged_bytes, bytes);
+    }
+}
+#endif
+
+#if MM_FIT_CACHE
+/*
+ * fit_cache_add: Notes a block just added to list seg_index. Blocks join
+ *                a list at its tail, so the cache takes the block only
+ *                while it holds the whole list and has a slot to spare.
+ */
+static void fit_cache_add(arena_t *arena, int seg_index, block_t *block)
+{
+    fit_cache_t *cache = &arena->fit_cache[seg_index];
+
+    if(cache->count == cache->length && cache->count < fit_cache_slots)
+    {
+        cache->size[cache->count] = get_size(block);
+        cache->block[cache->count] = block;
+        ++cache->count;
+    }
+    ++cache->length;
+}
+
+/*
+ * fit_cache_remove: Notes a block just taken off list seg_index. If it was
+ *                   cached, the entries after it move up, and the first
+ *                   uncached block of the list, which follows the last
+ *                   cached one, fills the freed slot.
+ */
+static void fit_cache_remove(arena_t *arena, int seg_index, block_t *block)
+{
+    fit_cache_t *cache = &arena->fit_cache[seg_index];
+    unsigned int j = 0;
+
+    --cache->length;
+    while(j < cache->count && cache->block[j] != block)
+    {
+        ++j;
+    }
+    if(j == cache->count)
+    {
+        return;
+    }
+    for(; j+1 < cache->count; ++j)
+    {
+        cache->size[j] = cache->size[j+1];
+        cache->block[j] = cache->block[j+1];
+    }
+    --cache->count;
+
+    if(cache->count < cache->length)
+    {
+        block_t *next = cache->count == 0 ? arena->free_ptr_list[seg_index] :
+                        find_next_free(cache->block[cache->count - 1]);
+        cache->size[cache->count] = get_size(next);
+        cache->block[cache->count] = next;
+        ++cache->count;
+    }
+}
+#endif
+
+/*
+ * mm_checkheap: Checks heap consistency in time linear in the size of the
+ *               heap. The free lists are walked first, marking each member,
+ *               and the heap walk then takes the mark of every free block,
+ *               so each block is looked at a bounded number of times. See
+ *               check_block for the tests done on each block.
+ */
+bool mm_checkheap(int line)
+{
+    int i, a;
+    block_t* cur_block;
+    arena_t* arena;
+    long listed = 0; // free list members marked
+    long found = 0;  // free blocks of the heap walk whose mark was taken
+#if MM_TREE
+    long tree_blocks = 0; // free blocks the size tree should hold
+#endif
+#if MM_PURGE_DECAY > 0
+    long queued = 0; // blocks in the purge queues, less those met in the heap
+#endif
+
+    // a failed check may have left marks behind
+    size_t mark_words = mem_heapsize() / (dsize * 64) + 1;
+    memset(check_marks, 0,
+           (mark_words < check_mark_words ? mark_words : check_mark_words) *
+           sizeof(word_t));
+
+    for(a=0; a<MM_ARENAS; ++a) {
+        arena = &arenas[a];
+#if MM_TLSF
+        // checking that the bitmaps agree with the lists
+        for(i=0; i<num_seg_lists; ++i) {
+            int fl = i >> tlsf_sl_log2;
+            bool sl_bit = (arena->tlsf_sl_bitmap[fl] >> (i & (tlsf_sl_count - 1))) & 1;
+            bool fl_bit = (arena->tlsf_fl_bitmap >> fl) & 1;
+            if(sl_bit != (arena->free_ptr_list[i] != NULL) || (sl_bit && !fl_bit))
+            {
+                printf("TLSF bitmap does not match list %i. Called at line %i\n",
+                       i, line);
+                return false;
+            }
+        }
+#endif
+
+#if MM_FASTBINS
+        // checking that parked blocks are allocated blocks of their bin size
+        for(i=0; i<fastbin_count; ++i) {
+            block_t *parked;
+            if(((arena->fastbin_map >> i) & 1) != (arena->fastbin[i] != NULL))
+            {
+                printf("Fast bin map does not match bin %i. Called at line %i\n",
+                       i, line);
+                return false;
+            }
+            for(parked=arena->fastbin[i]; parked!=NULL;
+                parked=parked->payload.parked_next) {
+                if((char*)parked < (char*)mem_heap_lo() ||
+                   (char*)parked > (char*)mem_heap_hi() ||
+                   !get_alloc(parked) || get_size(parked) != (i+1)*dsize ||
+                   get_arena(parked) != arena)
+                {
+                    printf("Bad block %p in fast bin %i. Called at line %i\n",
+                           parked, i, line);
+                    return false;
+                }
+            }
+        }
+#endif
+
+#if MM_REMOTE_FREE
+        // checking that queued remote frees are allocated blocks of the arena
+        for(cur_block=arena->remote_head; cur_block!=NULL;
+            cur_block=cur_block->payload.parked_next) {
+            if((char*)cur_block < (char*)mem_heap_lo() ||
+               (char*)cur_block > (char*)mem_heap_hi() ||
+               !get_alloc(cur_block) || get_arena(cur_block) != arena)
+            {
+                printf("Bad block %p in remote free queue. Called at line %i\n",
+                       cur_block, line);
+                return false;
+            }
+        }
+#endif
+
+#if MM_SLAB
+        // checking that partial runs have free slots and are linked
+        // properly, and that an empty run is only kept as the class's last
+        for(i=0; i<slab_classes; ++i) {
+            slab_run_t *run, *prev = NULL;
+            for(run=arena->slab_partial[i]; run!=NULL; run=run->next) {
+                if(slab_find_run(run) != run || run->prev != prev ||
+                   run->nfree == 0 || run->slot_size != (i+1)*dsize ||
+                   get_arena(payload_to_header(run)) != arena ||
+                   (run->nfree == run->nslots &&
+                    (prev != NULL || run->next != NULL)))
+                {
+                    printf("Bad run %p in partial list %i. Called at line %i\n",
+                           run, i, line);
+                    return false;
+                }
+                prev = run;
+            }
+        }
+#endif
+
+        // checking free list (only if free_ptr has been initialized)
+        for(i=0; i<num_seg_lists; ++i) {
+#if MM_FIT_CACHE
+            fit_cache_t *cache = &arena->fit_cache[i];
+            unsigned long pos = 0; // position in the list
+#endif
+            if(arena->free_ptr_list[i])
+            {
+                cur_block = arena->free_ptr_list[i];
+                block_t* last_block = find_prev_ptr(arena->free_ptr_list[i]);
+                do
+                {
+                    // checking the block lies in the heap before reading it
+                    if((char*)cur_block < (char*)mem_heap_lo() ||
+                       (char*)cur_block + wsize > (char*)mem_heap_hi())
+                    {
+                        printf("List %i points out of bounds at %p. "
+                               "Called at line %i\n", i, cur_block, line);
+                        return false;
+                    }
+                    // checking if prev matches
+                    if(find_prev_ptr(cur_block) != last_block)
+                    {
+                        printf("Prev pointer for block %p do not match. Called at %i\n",
+                                cur_block, line);
+                        return false;
+                    }
+                    // checking alloc bit to make sure block is free
+                    if(get_alloc(cur_block)) {
+                        printf("Block %p in free list but is not free. Called at line %i\n",
+                               cur_block, line);
+                        return false;
+                    }
+                    // checking the block is listed in its own arena
+                    if(get_arena(cur_block) != arena) {
+                        printf("Block %p in free list of another arena. Called at line %i\n",
+                               cur_block, line);
+                        return false;
+                    }
+                    // checking the block is in the list for its size
+                    if(find_list(get_size(cur_block)) != i) {
+                        printf("Block %p of size %li is in list %i. Called at line %i\n",
+                               cur_block, get_size(cur_block), i, line);
+                        return false;
+                    }
+#if MM_FIT_CACHE
+                    // checking the cached prefix matches the list
+                    if(i >= fit_cache_first && pos < cache->count &&
+                       (cache->block[pos] != cur_block ||
+                        cache->size[pos] != get_size(cur_block)))
+                    {
+                        printf("Fit cache of list %i does not match block %p. "
+                               "Called at line %i\n", i, cur_block, line);
+                        return false;
+                    }
+                    ++pos;
+#endif
+                    // marking it, which also ends a list that loops back on
+                    // itself short of the head
+                    if(!mark_listed(cur_block)) {
+                        printf("Block %p is in the free lists twice. Called at line %i\n",
+                               cur_block, line);
+                        return false;
+                    }
+                    ++listed;
+                    last_block = cur_block;
+                    cur_block = find_next_free(cur_block);
+                } while(arena->free_ptr_list[i] && cur_block != arena->free_ptr_list[i]);
+            }
+#if MM_FIT_CACHE
+            // checking the cache holds as much of the list as it can
+            if(i >= fit_cache_first &&
+               (cache->length != pos ||
+                cache->count != (pos < fit_cache_slots ? pos : fit_cache_slots)))
+            {
+                printf("Fit cache of list %i holds %u of %lu blocks, but the "
+                       "list has %lu. Called at line %i\n",
+                       i, cache->count, cache->length, pos, line);
+                return false;
+            }
+#endif
+        }
+
+#if MM_TREE
+        // checking the size tree's order and priorities
+        long nodes = tree_check(arena->tree_root, NULL, NULL, arena, line);
+        if(nodes < 0)
+        {
+            return false;
+        }
+        tree_blocks -= nodes;
+#endif
+
+#if MM_PURGE_DECAY > 0
+        // checking the purge queue links back and is in stamp order
+        block_t *prev_queued = NULL;
+        word_t last_stamp = 0;
+        for(cur_block=arena->purge_head; cur_block!=NULL;
+            cur_block=(block_t *)read_word(&purge_tag(cur_block)->next)) {
+            if((char*)cur_block < (char*)mem_heap_lo() ||
+               (char*)cur_block + wsize > (char*)mem_heap_hi() ||
+               get_alloc(cur_block) || get_size(cur_block) < MM_PURGE_MIN ||
+               get_arena(cur_block) != arena)
+            {
+                printf("Bad block %p in purge queue. Called at line %i\n",
+                       cur_block, line);
+                return false;
+            }
+            // a cycle fails this too, since the head's prev is NULL
+            word_t stamp = read_word(&purge_tag(cur_block)->stamp);
+            if((block_t *)read_word(&purge_tag(cur_block)->prev) != prev_queued ||
+               stamp < last_stamp || stamp > arena->purge_clock)
+            {
+                printf("Purge queue is out of order at %p. Called at line %i\n",
+                       cur_block, line);
+                return false;
+            }
+            prev_queued = cur_block;
+            last_stamp = stamp;
+            ++queued;
+        }
+        if(arena->purge_tail != prev_queued)
+        {
+            printf("Purge queue tail is not its last block. Called at line %i\n",
+                   line);
+            return false;
+        }
+#endif
+    }
+
+    // iterating over the entire heap
+    bool chunk_start = true;
+    for(cur_block=heap_start; cur_block!=NULL; cur_block=check_next(cur_block))
+    {
+        if(get_size(cur_block) == 0)
+        {
+            // the first chunk may not have grown past its epilogue yet
+            chunk_start = true;
+            continue;
+        }
+        if(!check_block(cur_block, chunk_start, line))
+        {
+            return false;
+        }
+        // the next block starts a chunk if this one is followed by an
+        // epilogue, which check_next steps over
+        chunk_start = get_size(find_next(cur_block)) == 0;
+
+        if(get_alloc(cur_block))
+        {
+            continue;
+        }
+#if MM_PURGE_DECAY > 0
+        // every large free block not yet purged must be queued
+        if(get_size(cur_block) >= MM_PURGE_MIN &&
+           read_word(&purge_tag(cur_block)->stamp) != purge_done)
+        {
+            --queued;
+        }
+#endif
+#if MM_TREE
+        if(in_tree(get_size(cur_block)))
+        {
+            ++tree_blocks;
+            continue;
+        }
+#endif
+        // checking the free block was met in its list
+        i=find_list(get_size(cur_block));
+        arena=get_arena(cur_block);
+        if(!take_mark(cur_block, arena->free_ptr_list[i]))
+        {
+            printf("Block %p is free but not in list. Called at line %i. "
+                   "in list %i, with size, %li\n",
+                    cur_block, line, i, get_size(cur_block));
+            return false;
+        }
+        ++found;
+    }
+
+    // every free block took one mark, so the rest are list members that are
+    // not free blocks of the heap
+    if(found != listed)
+    {
+        printf("Free lists hold %li blocks that are not free in the heap. "
+               "Called at line %i\n", listed - found, line);
+        return false;
+    }
+
+#if MM_TREE
+    // every node was found free in the heap, so the counts must agree
+    if(tree_blocks != 0)
+    {
+        printf("Size trees hold blocks that are not in the heap. "
+               "Called at line %i\n", line);
+        return false;
+    }
+#endif
+
+#if MM_PURGE_DECAY > 0
+    if(queued != 0)
+    {
+        printf("Purge queues are off by %li from the large free blocks not "
+               "yet purged. Called at line %i\n", queued, line);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*
+ * mm_checkheap_slice: Checks the next nblocks blocks of the heap with the
+ *                     same per-block tests as mm_checkheap, resuming where
+ *                     the previous call stopped and starting over once it
+ *                     reaches the end. Free list membership is checked
+ *                     through the links of each free block's neighbours,
+ *                     so a block linked into a list that no head reaches
+ *                     is only caught by mm_checkheap.
+ */
+bool mm_checkheap_slice(int line, size_t nblocks)
+{
+    block_t *block = check_cursor;
+    bool chunk_start = false;
+    size_t n;
+
+    if(heap_start == NULL)
+    {
+        return true;
+    }
+    if(block == NULL || (char*)block > (char*)mem_heap_hi())
+    {
+        block = heap_start;
+        chunk_start = true;
+    }
+
+    for(n=0; n<nblocks && block!=NULL; ++n, block=check_next(block))
+    {
+        if(get_size(block) == 0)
+        {
+            chunk_start = true;
+            continue;
+        }
+        if(!check_block(block, chunk_start, line))
+        {
+            check_cursor = NULL;
+            return false;
+        }
+        chunk_start = get_size(find_next(block)) == 0;
+    }
+    check_cursor = block;
+    return true;
+}
+
+/*
+ * check_block: Checks one block of the heap walk: its arena index and
+ *              extent, the prev bits and allocation of the block after it,
+ *              and for a free block its footer and its place in the free
+ *              lists or size tree. chunk_start is true if the block is the
+ *              first of its chunk. Used only in the heap checker
+ */
+static bool check_block(block_t *block, bool chunk_start, int line)
+{
+#if MM_ARENAS > 1
+    // checking the arena index
+    if((read_word(&block->header) >> arena_shift) >= MM_ARENAS)
+    {
+        printf("Block %p has a bad arena index. Called at line %i.\n",
+               block, line);
+        return false;
+    }
+#endif
+
+    // checking if the blocks are always within range
+    if(((char*)block+get_size(block)) > (char*)mem_heap_hi())
+    {
+        printf("Size of block %p extends past heap range."
+               "Called on line %i\n", block, line);
+        return false;
+    }
+
+    // the prologue footer before a chunk reads as an allocated block
+    if(chunk_start && (!get_prev_alloc(block) || get_prev_sblock(block)))
+    {
+        printf("Prev bits in block %p don't match the prologue. "
+               "Called at line %i.\n", block, line);
+        return false;
+    }
+
+    block_t *next = find_next(block);
+    if(get_size(next) != 0)
+    {
+        // checking prev_alloc bit
+        if(get_prev_alloc(next) != get_alloc(block))
+        {
+            printf("Prev_alloc bit in block %p don't match allocation in "
+                   "previous block. Called at line %i.\n", next, line);
+            return false;
+        }
+
+        // checking prev_sblock bit
+        if(get_prev_sblock(next) != get_sblock(block))
+        {
+            printf("Prev_sblock bit in block %p don't match allocation in "
+                   "previous block. Called at line %i.\n", next, line);
+            return false;
+        }
+
+        // checking for two contiguous free block
+        if(!get_alloc(block) && !get_alloc(next))
+        {
+            printf("Two consecutive free blocks %p. Called at line %i.\n",
+                    next, line);
+            return false;
+        }
+    }
+
+    // free block specific checks
+    if(!get_alloc(block))
+    {
+        // checking if headers and footers match
+        if(!get_sblock(block)) {
+            word_t* footerp = (word_t *)((block->payload.data) +
+                                get_size(block) - dsize);
+            if(read_word(&block->header) != read_word(footerp))
+            {
+                printf("Header and footer do not match for block "
+                        "%p. Called at line %i.\n", block, line);
+                return false;
+            }
+        }
+
+#if MM_TREE
+        // checking that large free blocks are in the size tree
+        if(in_tree(get_size(block)))
+        {
+            if(!tree_contains(get_arena(block), block))
+            {
+                printf("Block %p is free but not in the size tree. "
+                       "Called at line %i.\n", block, line);
+                return false;
+            }
+            return true;
+        }
+#endif
+
+        // checking if explicit list pointers are within the heap
+        block_t *next_free = find_next_free(block);
+        block_t *prev_free = find_prev_ptr(block);
+        if(next_free > (block_t*)mem_heap_hi() ||
+           next_free < (block_t*)mem_heap_lo() ||
+           prev_free > (block_t*)mem_heap_hi() ||
+           prev_free < (block_t*)mem_heap_lo())
+        {
+            printf("List nodes for block %p point out of bounds. "
+                   "Called at line %i\n", block, line);
+            return false;
+        }
+
+        // checking that its neighbours in the list are free and link back
+        if(get_alloc(next_free) || get_alloc(prev_free) ||
+           find_prev_ptr(next_free) != block || find_next_free(prev_free) != block)
+        {
+            printf("List neighbours of block %p are not free blocks linked "
+                   "to it. Called at line %i\n", block, line);
+            return false;
+        }
+
+        // if free_ptr is null, then there should not be any free blocks
+        if(!get_arena(block)->free_ptr_list[find_list(get_size(block))])
+        {
+            printf("Block %p is free but free_ptr is null. "
+                   "Called at line %i.\n",
+                    block, line);
+            return false;
+        }
+        return true;
+    }
+
+#if MM_SLAB
+    // checking slab runs
+    if(slab_find_run(header_to_payload(block)) == header_to_payload(block))
+    {
+        if(!slab_check_run(header_to_payload(block), line))
+        {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+/*
+ * check_next: Returns the block after block in the heap walk, stepping over
+ *             the epilogue and prologue footer between two chunks, or NULL
+ *             after the last block. Used only in the heap checker
+ */
+static block_t *check_next(block_t *block)
+{
+    block_t *next = find_next(block);
+    if(get_size(next) != 0)
+    {
+        return next;
+    }
+    // an epilogue below the break is followed by another chunk
+    if((char*)next + wsize > (char*)mem_heap_hi())
+    {
+        return NULL;
+    }
+    return (block_t*)((char*)next + dsize);
+}
+
+/*
+ * mark_listed: Marks a block met in a free list. Returns false if it was
+ *              marked already. Used only in the heap checker
+ */
+static bool mark_listed(block_t *block)
+{
+    size_t unit = ((char*)block - (char*)mem_heap_lo()) / dsize;
+    if(unit >= check_mark_words * 64)
+    {
+        return true;
+    }
+    word_t bit = (word_t)1 << (unit % 64);
+    if(check_marks[unit / 64] & bit)
+    {
+        return false;
+    }
+    check_marks[unit / 64] |= bit;
+    return true;
+}
+
+/*
+ * take_mark: Clears the mark of a free block met in the heap walk. Returns
+ *            false if it was not marked, so not in any free list. Blocks
+ *            past the marks are looked up in free_ptr's list. Used only in
+ *            the heap checker
+ */
+static bool take_mark(block_t *block, block_t *free_ptr)
+{
+    size_t unit = ((char*)block - (char*)mem_heap_lo()) / dsize;
+    if(unit >= check_mark_words * 64)
+    {
+        return in_list(block, free_ptr);
+    }
+    word_t bit = (word_t)1 << (unit % 64);
+    if(!(check_marks[unit / 64] & bit))
+    {
+        return false;
+    }
+    check_marks[unit / 64] &= ~bit;
+    return true;
+}
+
+/*
+ * forget_blocks: Called when the blocks strictly between lo and hi have
+ *                been merged into lo, so mm_checkheap_slice does not resume
+ *                from a header that no longer exists.
+ */
+static void forget_blocks(block_t *lo, block_t *hi)
+{
+    if(check_cursor > lo && check_cursor < hi)
+    {
+        check_cursor = lo;
+    }
+}
+
+#if MM_SLAB
+/*
+ * slab_check_run: Checks that a run's slot count and free count agree with
+ *                 its bitmap. Used only in the heap checker
+ */
+static bool slab_check_run(slab_run_t *run, int line)
+{
+    int i, used = 0;
+    if(run->slot_size == 0 || run->slot_size > slab_max_size ||
+       run->slot_size % dsize != 0 ||
+       run->nslots != (slab_run_size - wsize - slab_slot_offset) / run->slot_size)
+    {
+        printf("Run %p has a bad slot size. Called at line %i\n", run, line);
+        return false;
+    }
+    for(i=0; i<slab_map_words; ++i)
+    {
+        used += __builtin_popcountl(run->bitmap[i]);
+    }
+    // bits past nslots count as used
+    if(used != slab_map_words*64 - run->nfree)
+    {
+        printf("Run %p free count does not match its bitmap. "
+               "Called at line %i\n", run, line);
+        return false;
+    }
+    return true;
+}
+#endif
+
+/*
+ * in_list: Checks if the given block is in the free list. Used only in the
+ *          heap checker
+ */
+static bool in_list(block_t* block, block_t* free_ptr)
+{
+    block_t* cur_block = free_ptr;
+    if(free_ptr)
+    {
+        do
+        {
+            if(block == cur_block) {
+                return true;
+            }
+            cur_block = find_next_free(cur_block);
+#if MM_PREFETCH
+            __builtin_prefetch(find_next_free(cur_block));
+#endif
+        } while(free_ptr && cur_block != free_ptr);
     }
+    return false;
 }
 
 /*
- * find_fit: Given a size in bytes, finds a block in the heap that is large
- *           enough to fit the data. Returns a pointer to the block, or NULL if
- *           no block can fit the data.
+ * check_free_size: Checks that size could be the size the block at bp was
+ *                  last allocated or resized with: the payload holds it,
+ *                  and a heap block is less than a small block larger than
+ *                  size needs. Used only to check mm_free_sized callers.
  */
-static block_t *find_fit(size_t asize)
+static bool check_free_size(void *bp, size_t size, int line)
 {
-    int i;
-    int seg_index = find_list(asize);
-    block_t *best_block = NULL;
-    size_t size, min_size = mem_heapsize();
-    int num_read = 0;
+    block_t *block = payload_to_header(bp);
+    bool tight = true; // mapped blocks and slab slots are kept on shrinking
+    size_t usable;
 
-    for(i=seg_index; i<num_seg_lists; ++i) {
-        block_t *block = free_ptr_list[i];
-        // if the list is empty (head is null) don't look in it
-        if(block) {
-            do
-            {
-                size = get_size(block);
-                if (asize <= size)
-                {
-                    if(size < min_size)
-                    {
-                        min_size = size;
-                        best_block = block;
-                    }
-                    ++num_read;
-                }
-                if(num_read >= num_candidates)
-                {
-                    return best_block;
-                }
-                block = find_next_free(block);
-            } while(block != free_ptr_list[i]);
-        }
+#if MM_MMAP_THRESHOLD > 0
+    tight = !is_mapped(bp);
+#endif
+#if MM_SLAB
+    slab_run_t *run = slab_find_run(bp);
+    if (run != NULL)
+    {
+        usable = run->slot_size;
+        tight = false;
+    }
+    else
+#endif
+    {
+        usable = get_payload_size(block);
     }
 
-    // best block will be NULL if no fit was found, but the best fit if no other
-    // fit was found
-    return best_block;
+    if (size > usable ||
+        (tight && get_size(block) >= round_up(size + wsize, dsize) + min_block_size))
+    {
+        printf("Block %p freed with size %zu holds %zu bytes. Called at line %i\n",
+               bp, size, usable, line);
+        return false;
+    }
+    return true;
 }
 
+#if MM_TREE
 /*
- * add_free_block: adds free block to the explicit list using a LIFO policy.
- *                 Returns header of list the block was added to.
+ * tree_contains: Checks if the given block is in its arena's size tree. Used
+ *                only in the heap checker
  */
-static int add_free_block(block_t *block) {
-    // finding which list to add to based on size
-    block_t* free_ptr;
-    int seg_index = find_list(get_size(block));
-    free_ptr = free_ptr_list[seg_index];
-    if(free_ptr == NULL)
+static bool tree_contains(arena_t *arena, block_t *block)
+{
+    block_t *cur = arena->tree_root;
+    while(cur != NULL && cur != block)
     {
-        initialize_list(block, seg_index);
-        return seg_index;
+        cur = tree_less(block, cur) ? cur->payload.tree_node.left
+                                    : cur->payload.tree_node.right;
     }
-
-    // adding the element
-    block->payload.list_node.next = free_ptr;
-    write_prev_ptr(block, find_prev_ptr(free_ptr));
-    block_t* prev = find_prev_ptr(free_ptr);
-    prev->payload.list_node.next = block;
-    write_prev_ptr(free_ptr, block);
-    if(free_ptr == free_ptr->payload.list_node.next)
-        free_ptr->payload.list_node.next = block;
-    return seg_index;
+    return cur == block;
 }
 
 /*
- * remove_block: removes block from the list and updates the neighboring nodes
- *               accordingly. This method only unlinks pointers, and does not
- *               overwrite them in memory.
+ * tree_check: Checks that the subtree at root holds free blocks of arena in
+ *             key order between lo and hi (NULL for no bound), and that no
+ *             node outranks its parent. Returns the number of nodes, or -1
+ *             on error. Used only in the heap checker
  */
-static void remove_block(block_t *block)
+static long tree_check(block_t *root, block_t *lo, block_t *hi,
+                       arena_t *arena, int line)
 {
-    int seg_index = find_list(get_size(block));
-    block_t* free_ptr = free_ptr_list[seg_index];
+    if(root == NULL)
+    {
+        return 0;
+    }
+    if(get_alloc(root) || !in_tree(get_size(root)) ||
+       get_arena(root) != arena ||
+       (lo != NULL && !tree_less(lo, root)) ||
+       (hi != NULL && !tree_less(root, hi)))
+    {
+        printf("Block %p is out of place in the size tree. "
+               "Called at line %i\n", root, line);
+        return -1;
+    }
 
-    if(block == free_ptr) {
-        if(free_ptr != free_ptr->payload.list_node.next)
-            free_ptr_list[seg_index] = find_next_free(block);
-        else {
-            free_ptr_list[seg_index] = NULL;
-            return;
-        }
+    block_t *left = root->payload.tree_node.left;
+    block_t *right = root->payload.tree_node.right;
+    if((left != NULL && tree_priority(left) > tree_priority(root)) ||
+       (right != NULL && tree_priority(right) > tree_priority(root)))
+    {
+        printf("Children of block %p outrank it in the size tree. "
+               "Called at line %i\n", root, line);
+        return -1;
     }
-    block_t* next_blk = block->payload.list_node.next;
-    block_t* prev_blk = find_prev_ptr(block);
 
-    write_prev_ptr(next_blk, prev_blk);
-    prev_blk->payload.list_node.next = next_blk;
-    // --free_count;
+    long nleft = tree_check(left, lo, root, arena, line);
+    long nright = tree_check(right, root, hi, arena, line);
+    if(nleft < 0 || nright < 0)
+    {
+        return -1;
+    }
+    return nleft + nright + 1;
 }
+#endif
 
 /*
- * mm_checkheap: Checks heap consistency. See comments below for specific tests
+ * find_list: finds the corresponding list. Returns -1 if the block is small
  */
-bool mm_checkheap(int line)
+static int find_list(size_t size)
 {
-    // iterating over the entire heap
-    int i;
-    block_t* cur_block;
-    bool freed = false;
-    bool prev_alloc = true;
-    bool prev_sblock = false;
-    for(cur_block=heap_start; get_size(cur_block) > 0;
-        cur_block=find_next(cur_block))
+#if MM_TLSF
+    // first level 0 is linear in dsize steps
+    if(size < tlsf_small_size)
+        return size >> 4;
+    int msb = msb_index(size);
+    int fl = msb - (tlsf_sl_log2 + 4) + 1;
+    if(fl >= tlsf_fl_count) // everything beyond the last level shares a list
+        return num_seg_lists-1;
+    int sl = (size >> (msb - tlsf_sl_log2)) & (tlsf_sl_count - 1);
+    return fl*tlsf_sl_count + sl;
+#else
+    if(size < class_small_limit)
+        return class_small[size >> 4];
+    int msb = msb_index(size);
+    return class_large[(msb << 3) | ((size >> (msb - 3)) & 7)];
+#endif
+}
+
+#if MM_TLSF
+/*
+ * tlsf_find_fit: TLSF version of find_fit. Probes the head of the list asize
+ *                falls in, then rounds asize up to the next class boundary so
+ *                that any block in a non-empty list found through the bitmaps
+ *                is guaranteed to fit. Only the catch-all last list is walked.
+ */
+static block_t *tlsf_find_fit(arena_t *arena, size_t asize)
+{
+    int seg_index = find_list(asize);
+    block_t *block = arena->free_ptr_list[seg_index];
+
+    // one probe of the exact class keeps utilization close to a good fit
+    if(block != NULL)
     {
-        // checking prev_alloc bit
-        if(get_prev_alloc(cur_block) != prev_alloc)
+        count_stat(arena, stat_fit_candidates, 1);
+        if(get_size(block) >= asize)
         {
-            printf("Prev_alloc bit in block %p don't match allocation in "
-                   "previous block. Called at line %i.\n", cur_block, line);
-            return false;
+            return block;
         }
-        prev_alloc = get_alloc(cur_block);
+    }
 
-        // checking prev_sblock bit
-        if(get_prev_sblock(cur_block) != prev_sblock)
+    size_t rsize = asize;
+    if(asize >= tlsf_small_size)
+    {
+        rsize += ((size_t)1 << (msb_index(asize) - tlsf_sl_log2)) - 1;
+    }
+    seg_index = find_list(rsize);
+
+    int fl = seg_index >> tlsf_sl_log2;
+    int sl = seg_index & (tlsf_sl_count - 1);
+    uint32_t sl_map = arena->tlsf_sl_bitmap[fl] & (~(uint32_t)0 << sl);
+    if(sl_map == 0)
+    {
+        word_t fl_map = arena->tlsf_fl_bitmap & (~(word_t)0 << (fl + 1));
+        if(fl_map == 0)
         {
-            printf("Prev_sblock bit in block %p don't match allocation in "
-                   "previous block. Called at line %i.\n", cur_block, line);
-            return false;
+            return NULL;
         }
-        prev_sblock = get_sblock(cur_block);
+        fl = __builtin_ctzl(fl_map);
+        sl_map = arena->tlsf_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    seg_index = fl*tlsf_sl_count + sl;
+    block = arena->free_ptr_list[seg_index];
 
-        // checking for two contiguous free block
-        if(freed && !get_alloc(cur_block))
+    if(seg_index != num_seg_lists-1)
+    {
+        count_stat(arena, stat_fit_candidates, 1);
+        return block;
+    }
+    // the last list holds every size past the top level, so check them
+    do
+    {
+        count_stat(arena, stat_fit_candidates, 1);
+        if(get_size(block) >= asize)
         {
-            printf("Two consecutive free blocks %p. Called at line %i.\n",
-                    cur_block, line);
-            return false;
+            return block;
         }
+        block = find_next_free(block);
+    } while(block != arena->free_ptr_list[seg_index]);
+    return NULL;
+}
 
-        // free block specific checks
-        freed = !get_alloc(cur_block);
-        if(freed)
-        {
-            // checking if headers and footers match
-            if(!get_sblock(cur_block)) {
-                word_t* footerp = (word_t *)((cur_block->payload.data) +
-                                    get_size(cur_block) - dsize);
-                if(cur_block->header != *footerp)
-                {
-                    printf("Header and footer do not match for block "
-                            "%p. Called at line %i.\n", cur_block, line);
-                    return false;
-                }
-            }
+/*
+ * tlsf_set_bit: marks list seg_index as non-empty in both bitmaps
+ */
+static void tlsf_set_bit(arena_t *arena, int seg_index)
+{
+    int fl = seg_index >> tlsf_sl_log2;
+    arena->tlsf_sl_bitmap[fl] |= (uint32_t)1 << (seg_index & (tlsf_sl_count - 1));
+    arena->tlsf_fl_bitmap |= (word_t)1 << fl;
+}
 
+/*
+ * tlsf_clear_bit: marks list seg_index as empty, clearing the first level bit
+ *                 once every list in that level is empty.
+ */
+static void tlsf_clear_bit(arena_t *arena, int seg_index)
+{
+    int fl = seg_index >> tlsf_sl_log2;
+    arena->tlsf_sl_bitmap[fl] &= ~((uint32_t)1 << (seg_index & (tlsf_sl_count - 1)));
+    if(arena->tlsf_sl_bitmap[fl] == 0)
+    {
+        arena->tlsf_fl_bitmap &= ~((word_t)1 << fl);
+    }
+}
+#endif
 
-            // checking if explicit list pointers are within the heap
-            if(cur_block->payload.list_node.next > (block_t*)mem_heap_hi() ||
-               cur_block->payload.list_node.next < (block_t*)mem_heap_lo() ||
-               find_prev_ptr(cur_block) > (block_t*)mem_heap_hi() ||
-               find_prev_ptr(cur_block) < (block_t*)mem_heap_lo())
-            {
-                printf("List nodes for block %p point out of bounds. "
-                       "Called at line %i\n", cur_block, line);
-                return false;
-            }
+/*
+ * msb_index: returns the position of the most significant set bit of x
+ */
+static int msb_index(size_t x)
+{
+    return 63 - __builtin_clzl(x);
+}
 
-            i=find_list(get_size(cur_block));
-            // if free_ptr is null, then there should not be any free blocks
-            if(!free_ptr_list[i])
-            {
-                printf("Block %p is free but free_ptr is null. "
-                       "Called at line %i.\n",
-                        cur_block, line);
-                return false;
-            }
-            // checking if the free block is in the list
-            if(!in_list(cur_block, free_ptr_list[i]))
-            {
-                printf("Block %p is free but not in list. Called at line %i. "
-                       "in list %i, with size, %li\n",
-                        cur_block, line, i, get_size(cur_block));
-                return false;
-            }
-        }
+#if MM_TREE
+/*
+ * in_tree: returns true if free blocks of size are kept in the size tree
+ */
+static bool in_tree(size_t size)
+{
+    return size >= MM_TREE_MIN;
+}
 
-        // checking if the blocks are always within range
-        if(((char*)cur_block+get_size(cur_block)) > (char*)mem_heap_hi())
-        {
-            printf("Size of block %p extends past heap range."
-                   "Called on line %i\n", cur_block, line);
-            return false;
-        }
+/*
+ * tree_insert: Adds a free block to its arena's size tree. Walks down while
+ *              the nodes outrank the block, then splits the subtree found
+ *              there into the keys below and above the block, which become
+ *              its children.
+ */
+static void tree_insert(arena_t *arena, block_t *block)
+{
+    block_t **link = &arena->tree_root;
+    word_t priority = tree_priority(block);
+
+    while(*link != NULL && tree_priority(*link) > priority)
+    {
+        link = tree_less(block, *link) ? &(*link)->payload.tree_node.left
+                                       : &(*link)->payload.tree_node.right;
     }
 
-    // checking free list (only if free_ptr has been initialized)
-    for(i=0; i<num_seg_lists; ++i) {
-        if(free_ptr_list[i])
+    block_t *cur = *link;
+    block_t **left = &block->payload.tree_node.left;
+    block_t **right = &block->payload.tree_node.right;
+    while(cur != NULL)
+    {
+        if(tree_less(cur, block))
         {
-            cur_block = free_ptr_list[i];
-            block_t* last_block = find_prev_ptr(free_ptr_list[i]);
-            do
-            {
-                // checking if prev matches
-                if(find_prev_ptr(cur_block) != last_block)
-                {
-                    printf("Prev pointer for block %p do not match. Called at %i\n",
-                            cur_block, line);
-                    return false;
-                }
-                // checking alloc bit to make sure block is free
-                if(get_alloc(cur_block)) {
-                    printf("Block %p in free list but is not free. Called at line %i\n",
-                           cur_block, line);
-                    return false;
-                }
-                last_block = cur_block;
-                cur_block = find_next_free(cur_block);
-            } while(free_ptr_list[i] && cur_block != free_ptr_list[i]);
+            *left = cur;
+            left = &cur->payload.tree_node.right;
+            cur = cur->payload.tree_node.right;
+        }
+        else
+        {
+            *right = cur;
+            right = &cur->payload.tree_node.left;
+            cur = cur->payload.tree_node.left;
         }
     }
-
-
-    return true;
+    *left = NULL;
+    *right = NULL;
+    *link = block;
 }
 
 /*
- * in_list: Checks if the given block is in the free list. Used only in the
- *          heap checker
+ * tree_remove: Removes a free block from its arena's size tree by merging
+ *              its two subtrees in priority order in its place.
  */
-static bool in_list(block_t* block, block_t* free_ptr)
+static void tree_remove(arena_t *arena, block_t *block)
 {
-    block_t* cur_block = free_ptr;
-    if(free_ptr)
+    block_t **link = &arena->tree_root;
+
+    while(*link != block)
     {
-        do
+        dbg_assert(*link != NULL);
+        link = tree_less(block, *link) ? &(*link)->payload.tree_node.left
+                                       : &(*link)->payload.tree_node.right;
+    }
+
+    block_t *left = block->payload.tree_node.left;
+    block_t *right = block->payload.tree_node.right;
+    while(left != NULL && right != NULL)
+    {
+        if(tree_priority(left) > tree_priority(right))
         {
-            if(block == cur_block) {
-                return true;
-            }
-            cur_block = find_next_free(cur_block);
-        } while(free_ptr && cur_block != free_ptr);
+            *link = left;
+            link = &left->payload.tree_node.right;
+            left = left->payload.tree_node.right;
+        }
+        else
+        {
+            *link = right;
+            link = &right->payload.tree_node.left;
+            right = right->payload.tree_node.left;
+        }
     }
-    return false;
+    *link = left != NULL ? left : right;
 }
 
 /*
- * find_list: finds the corresponding list. Returns -1 if the block is small
+ * tree_find_fit: Returns the smallest free block in the size tree that holds
+ *                asize bytes, the lowest addressed one among equal sizes, or
+ *                NULL if none does.
  */
-static int find_list(size_t size)
+static block_t *tree_find_fit(arena_t *arena, size_t asize)
 {
-    if(size == min_block_size) // if its a small block
-        return 0;
-    // Performs linear search
-    int i;
-    size_t bsize = min_lblock_size;
-    for(i=1; i<num_seg_lists;++i)
+    block_t *best = NULL;
+    block_t *cur = arena->tree_root;
+
+    while(cur != NULL)
     {
-        if(size >= bsize && size < (bsize << seg_list_factor))
+        count_stat(arena, stat_fit_candidates, 1);
+        if(get_size(cur) >= asize)
+        {
+            best = cur;
+            cur = cur->payload.tree_node.left;
+        }
+        else
         {
-            return i;
+            cur = cur->payload.tree_node.right;
         }
-        bsize <<= seg_list_factor;
     }
-    return num_seg_lists-1;
+    return best;
+}
+
+/*
+ * tree_less: orders tree nodes by size, then by address
+ */
+static bool tree_less(block_t *a, block_t *b)
+{
+    size_t asize = get_size(a);
+    size_t bsize = get_size(b);
+    return asize < bsize || (asize == bsize && a < b);
+}
+
+/*
+ * tree_priority: returns the treap priority of a node, a multiplicative hash
+ *                of its address, so the tree is balanced in expectation
+ *                whatever order blocks are freed in.
+ */
+static word_t tree_priority(block_t *block)
+{
+    return ((word_t)block >> 4) * 0x9E3779B97F4A7C15;
 }
+#endif
 
 /*
  * max: returns x if x > y, and y otherwise.
@@ -801,7 +4810,7 @@ static size_t extract_size(word_t word)
  */
 static size_t get_size(block_t *block)
 {
-    return extract_size(block->header);
+    return extract_size(read_word(&block->header));
 }
 
 /*
@@ -829,7 +4838,7 @@ static bool extract_alloc(word_t word)
  */
 static bool get_alloc(block_t *block)
 {
-    return extract_alloc(block->header);
+    return extract_alloc(read_word(&block->header));
 }
 
 /*
@@ -847,7 +4856,7 @@ static bool extract_prev_alloc(word_t header)
  */
 static bool get_prev_alloc(block_t *block)
 {
-    return extract_prev_alloc(block->header);
+    return extract_prev_alloc(read_word(&block->header));
 }
 
 /*
@@ -856,7 +4865,7 @@ static bool get_prev_alloc(block_t *block)
  */
 static bool get_sblock(block_t *block)
 {
-    return extract_sblock(block->header);
+    return extract_sblock(read_word(&block->header));
 }
 
 /*
@@ -874,7 +4883,7 @@ static bool extract_sblock(word_t header)
  */
 static bool get_prev_sblock(block_t *block)
 {
-    return extract_prev_sblock(block->header);
+    return extract_prev_sblock(read_word(&block->header));
 }
 
 /*
@@ -894,8 +4903,11 @@ static bool extract_prev_sblock(word_t header)
  */
 static void write_header(block_t *block, size_t size, bool alloc)
 {
-    block->header = pack(size, alloc, block->header & prev_alloc_mask,
-                         size==dsize ? true:false, block->header & prev_sblock_mask);
+    word_t header = read_word(&block->header);
+    write_word(&block->header,
+               pack(size, alloc, header & prev_alloc_mask,
+                    size==dsize ? true:false, header & prev_sblock_mask) |
+               (header & arena_mask));
 }
 
 /*
@@ -910,8 +4922,10 @@ static void write_footer(block_t *block, size_t size, bool alloc)
     if(!get_sblock(block)) // small blocks have no footer
     {
         word_t *footerp = (word_t *)((block->payload.data) + get_size(block) - dsize);
-        *footerp = pack(size, alloc, block->header & prev_alloc_mask,
-                        false, block->header & prev_sblock_mask);
+        word_t header = read_word(&block->header);
+        write_word(footerp, pack(size, alloc, header & prev_alloc_mask,
+                                 false, header & prev_sblock_mask) |
+                            (header & arena_mask));
     }
 }
 
@@ -922,14 +4936,14 @@ static void write_footer(block_t *block, size_t size, bool alloc)
 static void update_prev_alloc(block_t *block, bool prev_alloc)
 {
     // writing prev_alloc for header
-    block->header &= ~prev_alloc_mask; // clearing prev_alloc bit
-    block->header |= prev_alloc << 1;  // writing the prev_alloc bit
+    write_word(&block->header, (read_word(&block->header) & ~prev_alloc_mask) |
+                               (word_t)prev_alloc << 1);
 
     // writing prev_alloc for footer
     if(!get_alloc(block) && !get_sblock(block)) {
         word_t *footerp = (word_t *)((block->payload.data) + get_size(block) - dsize);
-        *footerp &= ~prev_alloc_mask;
-        *footerp |= prev_alloc << 1;
+        write_word(footerp, (read_word(footerp) & ~prev_alloc_mask) |
+                            (word_t)prev_alloc << 1);
     }
 }
 
@@ -940,25 +4954,50 @@ static void update_prev_alloc(block_t *block, bool prev_alloc)
 static void update_prev_sblock(block_t *block, bool prev_sblock)
 {
     // writing prev_sblock for header
-    block->header &= ~prev_sblock_mask; // clearing prev_alloc bit
-    block->header |= prev_sblock << 3;  // writing the prev_alloc bit
+    write_word(&block->header, (read_word(&block->header) & ~prev_sblock_mask) |
+                               (word_t)prev_sblock << 3);
 
     // writing prev_sblock for footer only if block is not allocated
     if(!get_alloc(block) && !get_sblock(block)) {
         word_t *footerp = (word_t *)((block->payload.data) + get_size(block) - dsize);
-        *footerp &= ~prev_sblock_mask;
-        *footerp |= prev_sblock << 3;
+        write_word(footerp, (read_word(footerp) & ~prev_sblock_mask) |
+                            (word_t)prev_sblock << 3);
     }
 }
 
+/*
+ * get_arena: returns the arena a block belongs to, read from the top byte of
+ *            its header.
+ */
+static arena_t *get_arena(block_t *block)
+{
+#if MM_ARENAS > 1
+    return &arenas[read_word(&block->header) >> arena_shift];
+#else
+    return &arenas[0];
+#endif
+}
+
+/*
+ * write_arena: records in the header which arena a block belongs to. Must be
+ *              called for every header written over memory that was not
+ *              already a header of this arena.
+ */
+static void write_arena(block_t *block, arena_t *arena)
+{
+#if MM_ARENAS > 1
+    write_word(&block->header, (read_word(&block->header) & ~arena_mask) |
+                               ((word_t)(arena - arenas) << arena_shift));
+#endif
+}
+
 /*
  * initialize_list: Initializes circular linked list with the given block
  */
 static void initialize_list(block_t* block, int seg_index)
 {
-    free_ptr_list[seg_index] = block;
-    block->payload.list_node.next = block;
-    // block->payload.list_node.prev = block;
+    get_arena(block)->free_ptr_list[seg_index] = block;
+    write_next_ptr(block, block);
     write_prev_ptr(block, block);
 }
 
@@ -981,7 +5020,15 @@ static block_t *find_next(block_t *block)
  */
 static block_t *find_next_free(block_t *block)
 {
-    return block->payload.list_node.next;
+    return link_to_block(read_link(&block->payload.list_node.next));
+}
+
+/*
+ * write_next_ptr: writes the next pointer of a free block
+ */
+static void write_next_ptr(block_t* block, block_t* next)
+{
+    write_link(&block->payload.list_node.next, block_to_link(next));
 }
 
 /*
@@ -1008,7 +5055,7 @@ static block_t *find_prev(block_t *block)
     if(!get_prev_sblock(block))
     {
         word_t *footerp = find_prev_footer(block);
-        size_t size = extract_size(*footerp);
+        size_t size = extract_size(read_word(footerp));
         return (block_t *)((char *)block - size);
     }
     else
@@ -1021,18 +5068,23 @@ static block_t *find_prev(block_t *block)
 
 /*
  * find_prev_ptr: Returns the prev pointer in blocks. This method exists because
- *                small blocks store the prev pointer in the header.
+ *                small blocks store the prev pointer in the header, unless
+ *                compact links leave room for it in the payload.
  */
 static block_t *find_prev_ptr(block_t *block)
 {
+#if MM_COMPACT_LINKS
+    return link_to_block(read_link(&block->payload.list_node.prev));
+#else
     if(get_sblock(block))
     {
-        return (block_t*)((block->header & size_mask) + 0x8);
+        return (block_t*)((read_word(&block->header) & size_mask) + 0x8);
     }
     else
     {
-        return block->payload.list_node.prev;
+        return read_link(&block->payload.list_node.prev);
     }
+#endif
 }
 
 /*
@@ -1041,14 +5093,94 @@ static block_t *find_prev_ptr(block_t *block)
  */
 static void write_prev_ptr(block_t* block, block_t* prev)
 {
+#if MM_COMPACT_LINKS
+    write_link(&block->payload.list_node.prev, block_to_link(prev));
+#else
     if(get_sblock(block))
     {
-        block->header = ((word_t)prev & size_mask) | (block->header & ~size_mask);
+        write_word(&block->header, ((word_t)prev & size_mask) |
+                                   (read_word(&block->header) & ~size_mask));
     }
     else
     {
-        block->payload.list_node.prev = prev;
+        write_link(&block->payload.list_node.prev, prev);
     }
+#endif
+}
+
+/*
+ * read_word: returns the heap word at addr. The heap of a SPARSE_MODE build
+ *            is only reachable through memlib.
+ */
+static word_t read_word(const void *addr)
+{
+#if SPARSE_MODE
+    return mem_read(addr, sizeof(word_t));
+#else
+    return *(const word_t *)addr;
+#endif
+}
+
+/*
+ * write_word: stores val in the heap word at addr
+ */
+static void write_word(void *addr, word_t val)
+{
+#if SPARSE_MODE
+    mem_write(addr, val, sizeof(word_t));
+#else
+    *(word_t *)addr = val;
+#endif
+}
+
+/*
+ * read_link: returns the free list link stored at addr
+ */
+static link_t read_link(const link_t *addr)
+{
+#if SPARSE_MODE
+    return (link_t)mem_read(addr, sizeof(link_t));
+#else
+    return *addr;
+#endif
+}
+
+/*
+ * write_link: stores a free list link at addr
+ */
+static void write_link(link_t *addr, link_t link)
+{
+#if SPARSE_MODE
+    mem_write(addr, (word_t)link, sizeof(link_t));
+#else
+    *addr = link;
+#endif
+}
+
+/*
+ * link_to_block: returns the block a free list link refers to. Compact links
+ *                count dsize units from the start of the heap, and every
+ *                block header lies one word past a multiple of dsize.
+ */
+static block_t *link_to_block(link_t link)
+{
+#if MM_COMPACT_LINKS
+    return (block_t *)(link_base + ((size_t)link << 4) + wsize);
+#else
+    return link;
+#endif
+}
+
+/*
+ * block_to_link: returns the free list link that refers to block
+ */
+static link_t block_to_link(block_t *block)
+{
+#if MM_COMPACT_LINKS
+    return (link_t)(((char *)block - link_base) >> 4);
+#else
+    return block;
+#endif
 }
 
 /*
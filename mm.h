@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
@@ -8,6 +12,13 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_valloc(size_t size);
+extern void *mm_pvalloc(size_t size);
+extern void *mm_reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -16,10 +27,75 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void *valloc(size_t size);
+extern void *pvalloc(size_t size);
+extern void *reallocarray(void *ptr, size_t nmemb, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Allocate n blocks of size bytes into out, returning how many were made,
+ * and free n blocks at once (ptrs is sorted in the process) */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Free a block whose size, as last passed to malloc or realloc, is known */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/* A region hands out blocks from chunks of the heap by bumping a pointer,
+ * and frees them all at once on reset, keeping one chunk, or on destroy.
+ * Blocks are not freed one by one, and a region is used by one thread */
+typedef struct mm_region mm_region_t;
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_reset(mm_region_t *region);
+extern void mm_region_destroy(mm_region_t *region);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
+/* Checks the next nblocks blocks of the heap, wrapping around at its end */
+extern bool mm_checkheap_slice(int lineno, size_t nblocks);
+
+/* Number of arenas, and how often a thread had to wait for arena i's lock */
+extern int mm_arena_count(void);
+extern unsigned long mm_arena_contention(int i);
+
+/* Upper bound on the number of free list classes reported by mm_stats */
+#define MM_STATS_CLASSES 512
+
+/* Counters kept since mm_init by a build with MM_STATS, summed over arenas */
+typedef struct {
+    unsigned long mallocs;        /* blocks requested, by any entry point */
+    unsigned long frees;          /* blocks freed, by any entry point */
+    unsigned long reallocs;       /* realloc calls */
+    unsigned long fit_searches;   /* find_fit calls */
+    unsigned long fit_candidates; /* free blocks find_fit looked at */
+    unsigned long splits;         /* placements that split off a free block */
+    unsigned long exact_fits;     /* placements that took a whole block */
+    unsigned long coalesce_none;  /* freed blocks with no free neighbour */
+    unsigned long coalesce_next;  /* ... merged with the next block only */
+    unsigned long coalesce_prev;  /* ... merged with the previous block only */
+    unsigned long coalesce_both;  /* ... merged with both neighbours */
+    unsigned long heap_extends;   /* extend_heap calls that grew the heap */
+    unsigned long heap_trims;     /* times the break was lowered */
+    unsigned long fit_cycles;     /* find_fit cycles, with MM_STATS_CYCLES */
+    unsigned long purges;         /* free blocks whose pages were purged */
+    unsigned long purged_bytes;   /* bytes those purges gave back */
+    unsigned long remote_frees;   /* blocks freed through remote queues */
+    /* Free blocks in each class, and their bytes, when mm_stats was called */
+    int classes;
+    unsigned long class_blocks[MM_STATS_CLASSES];
+    unsigned long class_bytes[MM_STATS_CLASSES];
+} mm_stats_t;
+
+/* Fills in stats; returns false, leaving it alone, without MM_STATS */
+extern bool mm_stats(mm_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,150 @@
+/*
+ * mmnew.cc - C++ operator new and delete on top of the mm.c allocator.
+ *
+ * Linking this file into a C++ program routes its new and delete
+ * expressions to mm.c. The sized forms of delete, which the compiler
+ * calls when it knows the size of the object being destroyed, go to
+ * mm_free_sized so the allocator can skip reading the block header.
+ * Over-aligned types are allocated with memalign.
+ */
+#include <new>
+#include <cstddef>
+
+#include "mm.h"
+
+#ifdef DRIVER
+#define mm_new_malloc mm_malloc
+#define mm_new_memalign mm_memalign
+#define mm_new_free mm_free
+#else
+#define mm_new_malloc malloc
+#define mm_new_memalign memalign
+#define mm_new_free free
+#endif
+
+/* A new expression must not return NULL, even for an empty object */
+static void *new_block(std::size_t size)
+{
+    void *p = mm_new_malloc(size != 0 ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size)
+{
+    return new_block(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return new_block(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return mm_new_malloc(size != 0 ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return mm_new_malloc(size != 0 ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    mm_new_free(ptr);
+}
+
+/* The size is the one passed to the matching new, so it can be trusted */
+void operator delete(void *ptr, std::size_t size) noexcept
+{
+    mm_free_sized(ptr, size != 0 ? size : 1);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept
+{
+    mm_free_sized(ptr, size != 0 ? size : 1);
+}
+
+#ifdef __cpp_aligned_new
+static void *new_aligned_block(std::size_t size, std::align_val_t align)
+{
+    void *p = mm_new_memalign(static_cast<std::size_t>(align),
+                              size != 0 ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size, std::align_val_t align)
+{
+    return new_aligned_block(size, align);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align)
+{
+    return new_aligned_block(size, align);
+}
+
+void *operator new(std::size_t size, std::align_val_t align,
+                   const std::nothrow_t &) noexcept
+{
+    return mm_new_memalign(static_cast<std::size_t>(align),
+                           size != 0 ? size : 1);
+}
+
+void *operator new[](std::size_t size, std::align_val_t align,
+                     const std::nothrow_t &) noexcept
+{
+    return mm_new_memalign(static_cast<std::size_t>(align),
+                           size != 0 ? size : 1);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept
+{
+    mm_new_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+    mm_free_sized(ptr, size != 0 ? size : 1);
+}
+
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept
+{
+    mm_free_sized(ptr, size != 0 ? size : 1);
+}
+#endif
@@ -0,0 +1,384 @@
+/*
+ * mtbench.c - Multithreaded throughput benchmark for the mm package
+ *
+ * Every worker thread replays the same trace file against the shared heap,
+ * each with its own table of block pointers, so the threads churn through
+ * allocations concurrently. The benchmark reports the aggregate throughput
+ * for each thread count, which should scale with the number of threads as
+ * long as the allocator does not serialize them.
+ *
+ * With -p it instead plays ping-pong: two threads each allocate blocks and
+ * pass them through a ring to the other thread, which frees them, as in a
+ * producer/consumer pipeline. For comparison, the same run is made with
+ * each thread passing its blocks to itself, so every free is local.
+ *
+ * Build with "make mtbench"; mm.c is compiled with MM_THREADS for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAXLINE 1024
+#define MAXTHREADS 64
+#define RING 4096       /* ping-pong blocks in flight in each direction */
+
+/* One trace request, as in mdriver */
+typedef struct {
+    enum { ALLOC, FREE, REALLOC } type;
+    long index;
+    size_t size;
+} traceop_t;
+
+typedef struct {
+    int num_ids;
+    int num_ops;
+    traceop_t *ops;
+} trace_t;
+
+/* Parameters for one worker thread */
+typedef struct {
+    const trace_t *trace;
+    int reps;
+    pthread_barrier_t *start;
+} worker_t;
+
+/* Blocks passed from one thread to another, or back to the same thread */
+typedef struct {
+    void *slot[RING];
+    unsigned long head;     /* next slot to take, written by the receiver */
+    unsigned long tail;     /* next slot to fill, written by the sender */
+} ring_t;
+
+/* Parameters for one ping-pong thread */
+typedef struct {
+    ring_t *out;            /* where its blocks go */
+    ring_t *in;             /* where the blocks it frees come from */
+    long count;             /* blocks to allocate, and to free */
+    size_t size;
+    pthread_barrier_t *start;
+} pinger_t;
+
+static void app_error(const char *msg)
+{
+    fprintf(stderr, "mtbench: %s\n", msg);
+    exit(1);
+}
+
+/*
+ * read_trace - read a trace file in the format described in traces/README
+ */
+static trace_t *read_trace(const char *filename)
+{
+    FILE *fp;
+    trace_t *trace;
+    char type[MAXLINE];
+    int weight, i;
+    size_t max_bytes;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        app_error("could not open trace file");
+    trace = malloc(sizeof(trace_t));
+    if (fscanf(fp, "%d %d %d %zu", &weight, &trace->num_ids,
+               &trace->num_ops, &max_bytes) != 4)
+        app_error("bad trace header");
+    trace->ops = malloc(trace->num_ops * sizeof(traceop_t));
+
+    for (i = 0; i < trace->num_ops; i++) {
+        traceop_t *op = &trace->ops[i];
+        if (fscanf(fp, "%s", type) != 1)
+            app_error("trace ended early");
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            op->type = type[0] == 'a' ? ALLOC : REALLOC;
+            if (fscanf(fp, "%ld %zu", &op->index, &op->size) != 2)
+                app_error("bad trace line");
+            break;
+        case 'f':
+            op->type = FREE;
+            if (fscanf(fp, "%ld", &op->index) != 1)
+                app_error("bad trace line");
+            break;
+        default:
+            app_error("bogus type character in trace");
+        }
+    }
+    fclose(fp);
+    return trace;
+}
+
+/*
+ * worker - replay the trace reps times with a private block table
+ */
+static void *worker(void *arg)
+{
+    worker_t *w = arg;
+    const trace_t *trace = w->trace;
+    char **blocks = calloc(trace->num_ids, sizeof(char *));
+    int r, i;
+
+    pthread_barrier_wait(w->start);
+    for (r = 0; r < w->reps; r++) {
+        for (i = 0; i < trace->num_ops; i++) {
+            const traceop_t *op = &trace->ops[i];
+            switch (op->type) {
+            case ALLOC:
+                if ((blocks[op->index] = mm_malloc(op->size)) == NULL)
+                    app_error("mm_malloc failed");
+                break;
+            case REALLOC:
+                blocks[op->index] = mm_realloc(blocks[op->index], op->size);
+                if (blocks[op->index] == NULL && op->size != 0)
+                    app_error("mm_realloc failed");
+                break;
+            case FREE:
+                mm_free(op->index < 0 ? NULL : blocks[op->index]);
+                break;
+            }
+        }
+    }
+    free(blocks);
+    return NULL;
+}
+
+/*
+ * receive - free every block waiting in ring; returns how many there were
+ */
+static long receive(ring_t *ring)
+{
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    long n = tail - head;
+
+    for (; head != tail; head++)
+        mm_free(ring->slot[head % RING]);
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * pinger - allocate count blocks, passing each on through out, and free
+ *     the count blocks that arrive through in
+ */
+static void *pinger(void *arg)
+{
+    pinger_t *p = arg;
+    ring_t *out = p->out;
+    long i, freed = 0;
+
+    pthread_barrier_wait(p->start);
+    for (i = 0; i < p->count; i++) {
+        char *bp = mm_malloc(p->size);
+        if (bp == NULL)
+            app_error("mm_malloc failed");
+        bp[0] = (char) i;
+        while (out->tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE)
+               == RING) {
+            long n = receive(p->in);
+            freed += n;
+            if (n == 0)
+                sched_yield();
+        }
+        out->slot[out->tail % RING] = bp;
+        __atomic_store_n(&out->tail, out->tail + 1, __ATOMIC_RELEASE);
+        freed += receive(p->in);
+    }
+    while (freed < p->count) {
+        long n = receive(p->in);
+        freed += n;
+        if (n == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+/*
+ * run_pingpong - play ping-pong with count blocks of size bytes per thread,
+ *     each thread freeing the other's blocks if remote, or its own if not;
+ *     returns elapsed seconds
+ */
+static double run_pingpong(bool remote, size_t size, long count)
+{
+    pthread_t tid[2];
+    pinger_t p[2];
+    ring_t *rings = calloc(2, sizeof(ring_t));
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+    int i;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed");
+
+    pthread_barrier_init(&start, NULL, 3);
+    for (i = 0; i < 2; i++) {
+        p[i].out = &rings[remote ? 1 - i : i];
+        p[i].in = &rings[i];
+        p[i].count = count;
+        p[i].size = size;
+        p[i].start = &start;
+        pthread_create(&tid[i], NULL, pinger, &p[i]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start);
+    for (i = 0; i < 2; i++)
+        pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+    free(rings);
+
+    return (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+}
+
+/*
+ * run - replay the trace in nthreads threads; returns elapsed seconds
+ */
+static double run(const trace_t *trace, int nthreads, int reps)
+{
+    pthread_t tid[MAXTHREADS];
+    worker_t w;
+    pthread_barrier_t start;
+    struct timespec t0, t1;
+    int i;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed");
+
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    w.trace = trace;
+    w.reps = reps;
+    w.start = &start;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tid[i], NULL, worker, &w);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+
+    return (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+}
+
+/*
+ * print_contention - finish the result line with the number of contended
+ *     lock acquisitions per arena, which is what we size MM_ARENAS by
+ */
+static void print_contention(void)
+{
+    int i;
+    printf("  contention:");
+    for (i = 0; i < mm_arena_count(); i++)
+        printf(" %lu", mm_arena_contention(i));
+    printf("\n");
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-f <file>] [-t <n,n,...>] [-r <reps>]\n", prog);
+    fprintf(stderr, "       %s -p [-s <size>] [-n <blocks>]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Trace to replay (default ./traces/syn-struct.rep)\n");
+    fprintf(stderr, "\t-t <list>  Comma-separated thread counts (default 1,2,4,8,16,32)\n");
+    fprintf(stderr, "\t-r <reps>  Times each thread replays the trace (default 10)\n");
+    fprintf(stderr, "\t-p         Play ping-pong between two threads instead\n");
+    fprintf(stderr, "\t-s <size>  Ping-pong block size in bytes (default 64)\n");
+    fprintf(stderr, "\t-n <n>     Blocks each ping-pong thread allocates (default 1000000)\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    char *tracefile = "./traces/syn-struct.rep";
+    char threads[MAXLINE] = "1,2,4,8,16,32";
+    int reps = 10;
+    bool pingpong = false;
+    size_t size = 64;
+    long count = 1000000;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:t:r:ps:n:h")) != -1) {
+        switch (c) {
+        case 'f':
+            tracefile = optarg;
+            break;
+        case 't':
+            snprintf(threads, MAXLINE, "%s", optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'p':
+            pingpong = true;
+            break;
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (pingpong) {
+        int remote;
+        if (count < 1)
+            app_error("block count out of range");
+        mem_init(false);
+        printf("Ping-pong of %ld %zu-byte blocks per thread\n", count, size);
+        printf("%8s %10s %10s %8s\n", "frees", "ops", "msecs", "Kops");
+        for (remote = 0; remote <= 1; remote++) {
+            double secs = run_pingpong(remote, size, count);
+            double ops = 4.0 * count;   /* a malloc and a free per block */
+            printf("%8s %10.0f %10.3f %8.0f", remote ? "remote" : "local",
+                   ops, secs * 1000.0, ops / (secs * 1000.0));
+            print_contention();
+        }
+        mem_deinit();
+        return 0;
+    }
+
+    trace_t *trace = read_trace(tracefile);
+    mem_init(false);
+
+    printf("Replaying %s\n", tracefile);
+    printf("%8s %10s %10s %8s %6s\n", "threads", "ops", "msecs", "Kops", "eff");
+    double base = 0;
+    char *tok;
+    for (tok = strtok(threads, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1 || n > MAXTHREADS)
+            app_error("thread count out of range");
+        double secs = run(trace, n, reps);
+        double ops = (double) trace->num_ops * reps * n;
+        double kops = ops / (secs * 1000.0);
+        if (base == 0)
+            base = kops / n;
+        /* eff: throughput per thread relative to the first run */
+        printf("%8d %10.0f %10.3f %8.0f %6.2f",
+               n, ops, secs * 1000.0, kops, kops / (base * n));
+        print_contention();
+    }
+
+    mem_deinit();
+    free(trace->ops);
+    free(trace);
+    return 0;
+}